@@ -0,0 +1,271 @@
+//
+// Created by neepoo on 23-2-24.
+//
+#include <math.h>
+
+#include "aot.h"
+
+#ifdef CLOX_NATIVE
+#include <dlfcn.h>
+#endif
+
+/*
+ * Every stack slot becomes a local Value s<n>. The compiler knows how deep the stack is before each
+ * instruction, so each instruction turns into a statement on fixed locals and the C compiler is left
+ * with straight-line code to optimise. OP_RESERVE's saved values are simply the lowest locals.
+ */
+
+static void emitNumber(FILE *file, double number) {
+    if (isinf(number)) {
+        fprintf(file, "NUMBER_VAL(%sINFINITY)", number < 0 ? "-" : "");
+    } else {
+        // A hexadecimal literal is exact, so the library computes with the same bits as the VM.
+        fprintf(file, "NUMBER_VAL(%a)", number);
+    }
+}
+
+static void emitString(FILE *file, ObjString const *string) {
+    fprintf(file, "runtime->string(\"");
+    for (int i = 0; i < string->length; i++) {
+        unsigned char c = (unsigned char) string->chars[i];
+        if (c == '"' || c == '\\' || c == '?') {
+            fprintf(file, "\\%c", c);
+        } else if (c < ' ' || c >= 0x7F) {
+            // Always three octal digits, so a following digit is not taken as part of the escape.
+            fprintf(file, "\\%03o", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fprintf(file, "\", %d)", string->length);
+}
+
+static void emitValue(FILE *file, Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            fprintf(file, AS_BOOL(value) ? "BOOL_VAL(true)" : "BOOL_VAL(false)");
+            break;
+        case VAL_NIL:
+            fprintf(file, "NIL_VAL");
+            break;
+        case VAL_NUMBER:
+            emitNumber(file, AS_NUMBER(value));
+            break;
+        case VAL_OBJ:
+            emitString(file, AS_STRING(value));
+            break;
+    }
+}
+
+static void emitPush(FILE *file, int depth, Value value) {
+    fprintf(file, "    s%d = ", depth);
+    emitValue(file, value);
+    fprintf(file, ";\n");
+}
+
+static void emitTypeCheck(FILE *file, int depth, int operands, int line, const char *message) {
+    if (operands == 2) {
+        fprintf(file, "    if (!IS_NUMBER(s%d) || !IS_NUMBER(s%d)) return runtime->error(%d, \"%s\");\n",
+                depth - 2, depth - 1, line, message);
+    } else {
+        fprintf(file, "    if (!IS_NUMBER(s%d)) return runtime->error(%d, \"%s\");\n", depth - 1, line, message);
+    }
+}
+
+// `a op b` on the two numbers on top, wrapped with valueType.
+static void emitNumberOp(FILE *file, int depth, const char *valueType, const char *op) {
+    fprintf(file, "    s%d = %s(AS_NUMBER(s%d) %s AS_NUMBER(s%d));\n", depth - 2, valueType, depth - 2, op, depth - 1);
+}
+
+bool emitC(const Chunk *chunk, FILE *file) {
+    if (chunk->registers) return false;
+    Value const *constants = chunk->constants.values;
+
+    fprintf(file, "// Translated by clox --emit-c. Build with:\n");
+    fprintf(file, "//     cc -O2 -shared -fPIC -I<clox sources> -o expression.so this-file.c\n");
+    fprintf(file, "#include <math.h>\n\n#include \"aot.h\"\n\n");
+    fprintf(file, "const int %s = %d;\n\n", AOT_VERSION_NAME, AOT_VERSION);
+    fprintf(file, "InterpretResult %s(const AotRuntime *runtime) {\n", AOT_FUNCTION_NAME);
+    for (int i = 0; i < chunk->maxStack; i++) fprintf(file, "    Value s%d;\n", i);
+
+    int depth = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        uint8_t operand = offset + 1 < chunk->count ? chunk->code[offset + 1] : 0;
+        int line = chunk->lines[offset];
+        offset++;
+        switch (instruction) {
+            case OP_CONSTANT:
+                emitPush(file, depth++, constants[operand]);
+                offset++;
+                break;
+            CASE_SHORT_CONSTANTS:
+                emitPush(file, depth++, constants[instruction - OP_CONSTANT_0]);
+                break;
+            case OP_SMALLINT:
+                emitPush(file, depth++, NUMBER_VAL((int8_t) operand));
+                offset++;
+                break;
+            case OP_NIL:
+                emitPush(file, depth++, NIL_VAL);
+                break;
+            case OP_TRUE:
+                emitPush(file, depth++, BOOL_VAL(true));
+                break;
+            case OP_FALSE:
+                emitPush(file, depth++, BOOL_VAL(false));
+                break;
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:
+                fprintf(file, "    if (IS_STRING(s%d) && IS_STRING(s%d)) {\n", depth - 2, depth - 1);
+                fprintf(file, "        s%d = runtime->concatenate(s%d, s%d);\n", depth - 2, depth - 2, depth - 1);
+                fprintf(file, "    } else if (IS_NUMBER(s%d) && IS_NUMBER(s%d)) {\n", depth - 2, depth - 1);
+                fprintf(file, "    ");
+                emitNumberOp(file, depth, "NUMBER_VAL", "+");
+                fprintf(file, "    } else {\n");
+                fprintf(file, "        return runtime->error(%d, \"Operands must be two numbers or two strings.\");\n",
+                        line);
+                fprintf(file, "    }\n");
+                depth--;
+                break;
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_GREATER:
+            case OP_LESS: {
+                static const char *const ops[] = {
+                        [OP_SUBTRACT] = "-", [OP_MULTIPLY] = "*", [OP_DIVIDE] = "/", [OP_GREATER] = ">", [OP_LESS] = "<",
+                };
+                bool comparison = instruction == OP_GREATER || instruction == OP_LESS;
+                emitTypeCheck(file, depth, 2, line, "Operands must be numbers.");
+                emitNumberOp(file, depth, comparison ? "BOOL_VAL" : "NUMBER_VAL", ops[instruction]);
+                depth--;
+                break;
+            }
+            case OP_FADD:
+                emitNumberOp(file, depth--, "NUMBER_VAL", "+");
+                break;
+            case OP_FSUBTRACT:
+                emitNumberOp(file, depth--, "NUMBER_VAL", "-");
+                break;
+            case OP_FMULTIPLY:
+                emitNumberOp(file, depth--, "NUMBER_VAL", "*");
+                break;
+            case OP_FDIVIDE:
+                emitNumberOp(file, depth--, "NUMBER_VAL", "/");
+                break;
+            case OP_FGREATER:
+                emitNumberOp(file, depth--, "BOOL_VAL", ">");
+                break;
+            case OP_FLESS:
+                emitNumberOp(file, depth--, "BOOL_VAL", "<");
+                break;
+            case OP_FEQUAL:
+                emitNumberOp(file, depth--, "BOOL_VAL", "==");
+                break;
+            case OP_EQUAL:
+            case OP_EQUAL_NUM:
+                fprintf(file, "    s%d = BOOL_VAL(runtime->valuesEqual(s%d, s%d));\n", depth - 2, depth - 2, depth - 1);
+                depth--;
+                break;
+            case OP_CONCAT:
+                fprintf(file, "    s%d = runtime->concatenate(s%d, s%d);\n", depth - 2, depth - 2, depth - 1);
+                depth--;
+                break;
+            case OP_NOT:
+                fprintf(file, "    s%d = BOOL_VAL(IS_NIL(s%d) || (IS_BOOL(s%d) && !AS_BOOL(s%d)));\n",
+                        depth - 1, depth - 1, depth - 1, depth - 1);
+                break;
+            case OP_NEGATE:
+                emitTypeCheck(file, depth, 1, line, "Operand must be a number.");
+                // Fall through.
+            case OP_FNEGATE:
+                fprintf(file, "    s%d = NUMBER_VAL(-AS_NUMBER(s%d));\n", depth - 1, depth - 1);
+                break;
+            case OP_RESERVE:
+                for (int i = 0; i < operand; i++) emitPush(file, depth++, NIL_VAL);
+                offset++;
+                break;
+            case OP_STORE_SLOT:
+                fprintf(file, "    s%d = s%d;\n", operand, depth - 1);
+                offset++;
+                break;
+            case OP_LOAD_SLOT:
+                fprintf(file, "    s%d = s%d;\n", depth, operand);
+                depth++;
+                offset++;
+                break;
+            case OP_DUP:
+                fprintf(file, "    s%d = s%d;\n", depth, depth - 1);
+                depth++;
+                break;
+            case OP_RETURN:
+                fprintf(file, "    runtime->print(s%d);\n    return INTERPRET_OK;\n", depth - 1);
+                depth = 0;
+                break;
+            default:
+                return false;
+        }
+    }
+    fprintf(file, "}\n");
+    return true;
+}
+
+#ifdef CLOX_NATIVE
+
+static Value runtimeString(const char *chars, int length) {
+    return OBJ_VAL(copyString(chars, length));
+}
+
+static Value runtimeConcatenate(Value a, Value b) {
+    return concatenate(AS_STRING(a), AS_STRING(b));
+}
+
+static void runtimePrint(Value value) {
+    writeValue(&vm.out, value);
+    writeChar(&vm.out, '\n');
+}
+
+static InterpretResult runtimeError(int line, const char *message) {
+    runtimeErrorAt(line, "%s", message);
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+static const AotRuntime runtime = {
+        runtimeString,
+        runtimeConcatenate,
+        valuesEqual,
+        runtimePrint,
+        runtimeError,
+};
+
+InterpretResult runNative(const char *path) {
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (library == NULL) {
+        fprintf(stderr, "Could not load \"%s\": %s\n", path, dlerror());
+        return INTERPRET_COMPILE_ERROR;
+    }
+    const int *version = dlsym(library, AOT_VERSION_NAME);
+    AotFunction function;
+    // ISO C has no conversion from void * to a function pointer; POSIX guarantees this one works.
+    *(void **) &function = dlsym(library, AOT_FUNCTION_NAME);
+    if (version == NULL || *version != AOT_VERSION || function == NULL) {
+        fprintf(stderr, "\"%s\" was not built from this version of clox --emit-c.\n", path);
+        dlclose(library);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    InterpretResult result = function(&runtime);
+    // Every string the library made was copied into the VM's heap, so nothing points into it any more.
+    dlclose(library);
+    return result;
+}
+
+#else
+
+InterpretResult runNative(const char *path) {
+    fprintf(stderr, "Could not load \"%s\": clox was built without CLOX_NATIVE.\n", path);
+    return INTERPRET_COMPILE_ERROR;
+}
+
+#endif
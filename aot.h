@@ -0,0 +1,46 @@
+//
+// Created by neepoo on 23-2-24.
+//
+
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+ * Ahead-of-time translation. emitC() turns a compiled chunk into a C function that works on the same
+ * Values as the VM. Built into a shared object, e.g.
+ *     cc -O2 -shared -fPIC -I<clox sources> -o expr.so expr.c
+ * it is loaded by runNative() and called with an AotRuntime, through which it reaches the VM's strings,
+ * output and error reporting. The library needs no symbols from clox itself.
+ */
+
+// Bumped whenever AotRuntime or Value changes, so an old library is refused rather than misread.
+#define AOT_VERSION 1
+
+typedef struct {
+    Value (*string)(const char *chars, int length);
+    Value (*concatenate)(Value a, Value b);
+    bool (*valuesEqual)(Value a, Value b);
+    void (*print)(Value value);  // the result, as OP_RETURN prints it
+    InterpretResult (*error)(int line, const char *message);  // reports it like a runtime error in the VM
+} AotRuntime;
+
+// The function every translated expression defines.
+typedef InterpretResult (*AotFunction)(const AotRuntime *runtime);
+
+#define AOT_FUNCTION_NAME "cloxExpression"
+#define AOT_VERSION_NAME "cloxAotVersion"
+
+// Writes chunk (stack code) as C source. Returns false if it holds instructions emitC() cannot translate.
+bool emitC(const Chunk *chunk, FILE *file);
+
+// Loads a library built from emitC() output and runs its expression. Only built with CLOX_NATIVE:
+// a statically linked clox cannot dlopen().
+InterpretResult runNative(const char *path);
+
+#endif
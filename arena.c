@@ -0,0 +1,110 @@
+//
+// Created by neepoo on 23-2-27.
+//
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Every allocation is rounded up to this, which suits any Value or object.
+#define ARENA_ALIGNMENT 16
+#define ALIGN_UP(size) (((size) + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1))
+// The header is padded to the alignment as well, so every block starts its data aligned.
+#define BLOCK_DATA(block) ((char *) (block) + ALIGN_UP(sizeof(ArenaBlock)))
+
+void initArena(Arena *arena) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+    arena->last = NULL;
+    arena->blockBytes = 0;
+    arena->blockLimit = SIZE_MAX;
+}
+
+void freeArena(Arena *arena) {
+    ArenaBlock *block = arena->first;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    initArena(arena);
+}
+
+void resetArena(Arena *arena) {
+    arena->current = arena->first;
+    arena->next = arena->first == NULL ? NULL : BLOCK_DATA(arena->first);
+    arena->end = arena->first == NULL ? NULL : arena->next + arena->first->size;
+    arena->last = NULL;
+}
+
+static void useBlock(Arena *arena, ArenaBlock *block) {
+    arena->current = block;
+    arena->next = BLOCK_DATA(block);
+    arena->end = arena->next + block->size;
+}
+
+// Moves on to a block with room for size bytes: the next one kept from before a reset if it is big
+// enough, otherwise a new one linked in after the current block. Returns false if there is none.
+static bool nextBlock(Arena *arena, size_t size) {
+    ArenaBlock *following = arena->current == NULL ? arena->first : arena->current->next;
+    if (following != NULL && following->size >= size) {
+        useBlock(arena, following);
+        return true;
+    }
+    size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    // Near the limit a block just big enough is still better than none.
+    if (blockSize > arena->blockLimit) blockSize = size;
+    if (blockSize > arena->blockLimit) return false;
+    ArenaBlock *block = (ArenaBlock *) malloc(ALIGN_UP(sizeof(ArenaBlock)) + blockSize);
+    if (block == NULL) return false;
+    arena->blockBytes += blockSize;
+    block->size = blockSize;
+    block->next = following;
+    if (arena->current == NULL) {
+        arena->first = block;
+    } else {
+        arena->current->next = block;
+    }
+    useBlock(arena, block);
+    return true;
+}
+
+static void *allocate(Arena *arena, size_t size) {
+    size = ALIGN_UP(size);
+    if ((size_t) (arena->end - arena->next) < size && !nextBlock(arena, size)) return NULL;
+    arena->last = arena->next;
+    arena->next += size;
+    return arena->last;
+}
+
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize) {
+    if (pointer != NULL && pointer == arena->last) {
+        // The latest allocation: free or resize it where it is, if the block has room.
+        if (newSize == 0) {
+            arena->next = arena->last;
+            arena->last = NULL;
+            return NULL;
+        }
+        if ((size_t) (arena->end - arena->last) >= ALIGN_UP(newSize)) {
+            arena->next = arena->last + ALIGN_UP(newSize);
+            return pointer;
+        }
+    }
+    if (newSize == 0) return NULL;
+
+    void *result = allocate(arena, newSize);
+    if (result == NULL) return NULL;
+    if (pointer != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+bool arenaOwns(const Arena *arena, const void *pointer) {
+    const char *address = (const char *) pointer;
+    for (const ArenaBlock *block = arena->first; block != NULL; block = block->next) {
+        if (address >= BLOCK_DATA(block) && address < BLOCK_DATA(block) + block->size) return true;
+    }
+    return false;
+}
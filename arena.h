@@ -0,0 +1,45 @@
+//
+// Created by neepoo on 23-2-27.
+//
+
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+// The block size the arena starts with; bigger requests get a block of their own size.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;  // usable bytes, which follow this header
+} ArenaBlock;
+
+/*
+ * A bump allocator. Allocating moves a pointer; freeing does nothing, except that the most recent
+ * allocation can still grow or shrink in place, which is what a growing array mostly does. resetArena()
+ * hands everything back in one step and keeps the blocks, so a steady workload stops calling malloc().
+ */
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+    char *next;
+    char *end;
+    char *last;  // the most recent allocation
+    size_t blockBytes;  // the usable bytes of every block, in use or kept
+    size_t blockLimit;  // the most new block bytes arenaReallocate() may take; SIZE_MAX for no limit
+} Arena;
+
+void initArena(Arena *arena);
+
+void freeArena(Arena *arena);
+
+void resetArena(Arena *arena);
+
+// Same contract as reallocate(), for memory owned by the arena, except that it returns NULL when a new
+// block would break blockLimit or malloc() fails.
+void *arenaReallocate(Arena *arena, void *pointer, size_t oldSize, size_t newSize);
+
+bool arenaOwns(const Arena *arena, const void *pointer);
+
+#endif
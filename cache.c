@@ -0,0 +1,118 @@
+//
+// Created by neepoo on 23-3-10.
+//
+#include <string.h>
+
+#include "cache.h"
+#include "memory.h"
+#include "object.h"
+
+void initChunkCache(ChunkCache *cache) {
+    cache->entries = NULL;
+    cache->capacity = 0;
+    cache->count = 0;
+    cache->newest = -1;
+    cache->oldest = -1;
+    initTable(&cache->sources);
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+}
+
+static void freeEntry(CachedChunk *entry) {
+    FREE_ARRAY_AS(MEM_STRING_CHARS, char, entry->source->chars, entry->source->length + 1);
+    FREE(ObjString, entry->source);
+    freeChunk(&entry->chunk);
+}
+
+static void clear(ChunkCache *cache) {
+    for (int i = 0; i < cache->count; i++) freeEntry(&cache->entries[i]);
+    FREE_ARRAY(CachedChunk, cache->entries, cache->capacity);
+    freeTable(&cache->sources);
+}
+
+void freeChunkCache(ChunkCache *cache) {
+    clear(cache);
+    initChunkCache(cache);
+}
+
+void resizeChunkCache(ChunkCache *cache, int capacity) {
+    size_t hits = cache->hits;
+    size_t misses = cache->misses;
+    size_t evictions = cache->evictions;
+    freeChunkCache(cache);
+    cache->hits = hits;
+    cache->misses = misses;
+    cache->evictions = evictions;
+    if (capacity <= 0) return;
+    cache->entries = ALLOCATE(CachedChunk, capacity);
+    cache->capacity = capacity;
+}
+
+static void detach(ChunkCache *cache, int index) {
+    CachedChunk *entry = &cache->entries[index];
+    if (entry->newer != -1) {
+        cache->entries[entry->newer].older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older != -1) {
+        cache->entries[entry->older].newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+static void linkNewest(ChunkCache *cache, int index) {
+    CachedChunk *entry = &cache->entries[index];
+    entry->newer = -1;
+    entry->older = cache->newest;
+    if (cache->newest != -1) cache->entries[cache->newest].newer = index;
+    cache->newest = index;
+    if (cache->oldest == -1) cache->oldest = index;
+}
+
+Chunk *findCachedChunk(ChunkCache *cache, const char *source, size_t length) {
+    if (cache->capacity == 0) return NULL;
+    ObjString *key = tableFindString(&cache->sources, source, (int) length, hashString(source, (int) length));
+    if (key == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    Value index;
+    tableGet(&cache->sources, key, &index);
+    int slot = (int) AS_NUMBER(index);
+    if (slot != cache->newest) {
+        detach(cache, slot);
+        linkNewest(cache, slot);
+    }
+    return &cache->entries[slot].chunk;
+}
+
+Chunk *cacheChunk(ChunkCache *cache, const char *source, size_t length, Chunk *compiled) {
+    int slot;
+    if (cache->count < cache->capacity) {
+        slot = cache->count++;
+    } else {
+        slot = cache->oldest;
+        detach(cache, slot);
+        tableDelete(&cache->sources, cache->entries[slot].source);
+        freeEntry(&cache->entries[slot]);
+        cache->evictions++;
+    }
+
+    CachedChunk *entry = &cache->entries[slot];
+    ObjString *key = ALLOCATE(ObjString, 1);
+    key->obj.type = OBJ_STRING;
+    key->length = (int) length;
+    key->chars = ALLOCATE_AS(MEM_STRING_CHARS, char, length + 1);
+    memcpy(key->chars, source, length);
+    key->chars[length] = '\0';
+    key->hash = hashString(source, (int) length);
+    entry->source = key;
+    entry->chunk = *compiled;
+    tableSet(&cache->sources, key, NUMBER_VAL(slot));
+    linkNewest(cache, slot);
+    return &entry->chunk;
+}
@@ -0,0 +1,50 @@
+//
+// Created by neepoo on 23-3-10.
+//
+
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "chunk.h"
+#include "table.h"
+
+typedef struct {
+    ObjString *source;  // the key: a copy of the source text, not in vm.heap and in no intern table
+    Chunk chunk;
+    int newer;  // neighbours in recency order, -1 at either end
+    int older;
+} CachedChunk;
+
+/*
+ * Chunks compiled by interpretLength(), kept by source text so a source seen before runs without
+ * compile(). The lookup hashes the text and compares it in full; sources is keyed by ObjStrings the
+ * cache makes for itself, the way an image keys its chunks. Once capacity chunks are held, each new one
+ * replaces the least recently used.
+ */
+typedef struct {
+    CachedChunk *entries;
+    int capacity;
+    int count;
+    int newest;
+    int oldest;
+    Table sources;  // source text -> index into entries, as a number
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} ChunkCache;
+
+void initChunkCache(ChunkCache *cache);
+
+void freeChunkCache(ChunkCache *cache);
+
+// Empties the cache and makes room for capacity chunks; 0 turns it off. The counters carry on.
+void resizeChunkCache(ChunkCache *cache, int capacity);
+
+// The cached chunk for this source, now the most recently used, or NULL. Counts a hit or a miss.
+Chunk *findCachedChunk(ChunkCache *cache, const char *source, size_t length);
+
+// Takes over the compiled chunk for this source, evicting the oldest entry if the cache is full, and
+// returns where it now lives. The source must not be cached already.
+Chunk *cacheChunk(ChunkCache *cache, const char *source, size_t length, Chunk *compiled);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdio.h>
 
 #include "chunk.h"
+#include "jit.h"
 #include "memory.h"
 
 void initChunk(Chunk *chunk) {
@@ -11,6 +12,11 @@ void initChunk(Chunk *chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->maxStack = 0;
+    chunk->registers = false;
+    chunk->runs = 0;
+    chunk->native = NULL;
+    chunk->nativeSize = 0;
     initValueArray(&chunk->constants);
 }
 
@@ -18,8 +24,8 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1){
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY_AS(MEM_CHUNK_CODE, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY_AS(MEM_CHUNK_LINES, int, chunk->lines, oldCapacity, chunk->capacity);
 
     }
     chunk->code[chunk->count] = byte;
@@ -28,12 +34,30 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
 }
 
 void freeChunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY_AS(MEM_CHUNK_CODE, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY_AS(MEM_CHUNK_LINES, int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    jitFree(chunk);
     initChunk(chunk);
 }
 
+int instructionLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_RESERVE:
+        case OP_STORE_SLOT:
+        case OP_LOAD_SLOT:
+        case OP_SMALLINT:
+        case OP_R_RETURN:
+            return 2;
+        case OP_R_LOADK:
+            return 3;
+        default:
+            // Every other register instruction has a destination and two operands, used or not.
+            return instruction > OP_R_LOADK ? 4 : 1;
+    }
+}
+
 int addConstant(Chunk *chunk, Value value) {
     writeValueArray(&chunk->constants, value);
     // After we add the constant,
@@ -26,8 +26,76 @@ typedef enum {
     OP_NOT,
     OP_NEGATE,
     OP_RETURN, // "return from the current function"
+    // Quickened forms. The compiler never emits these; run() rewrites a generic instruction into one
+    // after seeing its operand types, and rewrites it back if a later execution sees different types.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    // Unchecked forms for operands the compiler has proven to be numbers (or, for OP_CONCAT, strings).
+    OP_FADD,
+    OP_FSUBTRACT,
+    OP_FMULTIPLY,
+    OP_FDIVIDE,
+    OP_FGREATER,
+    OP_FLESS,
+    OP_FEQUAL,
+    OP_FNEGATE,
+    OP_CONCAT,
+    // Common subexpressions. OP_RESERVE n makes room for n saved values at the bottom of the stack,
+    // OP_STORE_SLOT copies the top into one of them and OP_LOAD_SLOT pushes it again.
+    OP_RESERVE,
+    OP_STORE_SLOT,
+    OP_LOAD_SLOT,
+    OP_DUP,
+    // Compact encodings for the commonest constants. OP_SMALLINT carries an integer from -128 to 127 as a
+    // signed operand byte and needs no constant-table entry at all; OP_CONSTANT_0 to OP_CONSTANT_15 load
+    // the first sixteen constants without an operand byte.
+    OP_SMALLINT,
+    OP_CONSTANT_0,
+    OP_CONSTANT_15 = OP_CONSTANT_0 + 15,
 } OpCode;
 
+#define SHORT_CONSTANTS 16
+
+// The case labels of OP_CONSTANT_0 to OP_CONSTANT_15, for switches over instructions.
+#define CASE_SHORT_CONSTANTS \
+    case OP_CONSTANT_0: case OP_CONSTANT_0 + 1: case OP_CONSTANT_0 + 2: case OP_CONSTANT_0 + 3: \
+    case OP_CONSTANT_0 + 4: case OP_CONSTANT_0 + 5: case OP_CONSTANT_0 + 6: case OP_CONSTANT_0 + 7: \
+    case OP_CONSTANT_0 + 8: case OP_CONSTANT_0 + 9: case OP_CONSTANT_0 + 10: case OP_CONSTANT_0 + 11: \
+    case OP_CONSTANT_0 + 12: case OP_CONSTANT_0 + 13: case OP_CONSTANT_0 + 14: case OP_CONSTANT_15
+
+/*
+ * The register instruction set. Each instruction names its destination register and its operands
+ * directly, e.g. OP_R_ADD dst a b, instead of going through the stack. Registers live in the VM stack
+ * starting where the chunk starts running; chunk->maxStack is how many it needs. An operand byte below
+ * RK_CONSTANT is a register, from RK_CONSTANT up it is constant number (byte - RK_CONSTANT), so most
+ * constants never need an instruction of their own.
+ */
+typedef enum {
+    OP_R_LOADK = OP_CONSTANT_15 + 1,  // dst, constant index: for constants past the reach of an operand
+    OP_R_ADD,       // dst, a, b
+    OP_R_SUBTRACT,
+    OP_R_MULTIPLY,
+    OP_R_DIVIDE,
+    OP_R_GREATER,
+    OP_R_LESS,
+    OP_R_EQUAL,
+    OP_R_FADD,      // operands proven to be numbers, as for OP_FADD
+    OP_R_FSUBTRACT,
+    OP_R_FMULTIPLY,
+    OP_R_FDIVIDE,
+    OP_R_FGREATER,
+    OP_R_FLESS,
+    OP_R_FEQUAL,
+    OP_R_CONCAT,
+    OP_R_NOT,       // dst, a
+    OP_R_NEGATE,
+    OP_R_FNEGATE,
+    OP_R_RETURN,    // a
+} RegisterOpCode;
+
+#define RK_CONSTANT 128
+
 // bytecode is a series of instruction, we'll store some other data along with
 // the instruction, create a struct to hold it
 
@@ -37,6 +105,11 @@ typedef struct {
     uint8_t *code;  // a simple wrapper of dynamic array
     int* lines;  // Every time we touch the code array, we make a corresponding change to the line number array,
     ValueArray constants;  // store the chuck's constants
+    int maxStack;  // the most values this code ever has on the stack at once, worked out by the compiler
+    bool registers;  // the code is OP_R_* register instructions
+    int runs;  // how often interpretChunk() has run it, to decide when the JIT should compile it
+    void *native;  // machine code from the JIT, or NULL
+    size_t nativeSize;
 } Chunk;
 
 
@@ -48,5 +121,8 @@ void freeChunk(Chunk *chunk);
 // append a byte to the end of chuck
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+
+// How many bytes the instruction starting with this opcode takes, operands included.
+int instructionLength(uint8_t instruction);
 #endif
 
@@ -1,10 +1,12 @@
 //
 // Created by neepoo on 23-1-6.
 //
+#include <math.h>
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
+#include "memory.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -47,6 +49,25 @@ typedef struct {
 } ParseRule;
 Parser parser;
 Chunk *compilingChunk;
+int stackDepth;  // how many values the code emitted so far leaves on the VM stack
+int codeLine;  // the line emitByte() records
+
+// What the compiler can prove about the value in each stack slot. TYPE_UNKNOWN is the top of the
+// lattice: the value may be anything, so the VM has to check it.
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+    TYPE_BOOL,
+    TYPE_NIL,
+    TYPE_STRING,
+} StaticType;
+
+typedef struct {
+    int capacity;
+    uint8_t *entries;  // StaticType per stack slot, index stackDepth - 1 is the top
+} TypeStack;
+
+TypeStack types;
 
 static Chunk *currentChunk() {
     return compilingChunk;
@@ -56,16 +77,17 @@ static Chunk *currentChunk() {
 static void errorAt(Token *token, const char *msg) {
     if (parser.panicMode) return; //  The trick is that while the panic mode flag is set, we simply suppress any other errors that get detected.
     parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
+    writeFormat(&vm.err, "[line %d] Error", token->line);
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        writeFormat(&vm.err, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        writeFormat(&vm.err, " at '%.*s'", token->length, token->start);
     }
     // WHY？这里的msg不是\0结尾的str，这样打印不会有问题吗？
-    fprintf(stderr, ": %s\n", msg);
+    writeFormat(&vm.err, ": %s\n", msg);
+    flushWriter(&vm.err);
     parser.hadError = true;
 }
 
@@ -99,9 +121,10 @@ static void consume(TokenType type, const char *msg) {
 }
 
 // It writes the given byte, which may be an opcode or an operand to an instruction.
+// Code is generated after the whole expression has been parsed, so each instruction carries the line
+// that parser.previous was on when the parser finished the piece of the expression it belongs to.
 static void emitByte(uint8_t byte) {
-    // WHY?为什么这里是前一个token的line？而不是当前的token
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(), byte, codeLine);
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -109,11 +132,32 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+// Every emitter reports the values its instruction consumes and produces. With no jumps in the language
+// the running height is exact, and its peak is all the stack the chunk will ever need. Each value also
+// carries the type the compiler could prove for it.
+static void pushType(StaticType type) {
+    if (types.capacity < stackDepth + 1) {
+        int oldCapacity = types.capacity;
+        types.capacity = GROW_CAPACITY(oldCapacity);
+        types.entries = GROW_ARRAY(uint8_t, types.entries, oldCapacity, types.capacity);
+    }
+    types.entries[stackDepth++] = (uint8_t) type;
+    if (stackDepth > currentChunk()->maxStack) currentChunk()->maxStack = stackDepth;
+}
+
+static StaticType popType() {
+    // After a parse error the stack may be unbalanced; the chunk will be thrown away anyway.
+    if (stackDepth == 0) return TYPE_UNKNOWN;
+    return (StaticType) types.entries[--stackDepth];
+}
+
 static void emitReturn() {
     emitByte(OP_RETURN);
+    popType();
 }
 
 static uint8_t makeConstant(Value value) {
+    // Identical constants share a node in the expression DAG, so each value reaches here only once.
     int constant = addConstant(currentChunk(), value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
@@ -122,12 +166,43 @@ static uint8_t makeConstant(Value value) {
     return (uint8_t) constant;
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+// Numbers that are small integers travel inside the instruction stream instead of the constant table.
+static bool isSmallInt(Value value) {
+    if (!IS_NUMBER(value)) return false;
+    double number = AS_NUMBER(value);
+    // -0 is not an integer here: it has to keep its sign.
+    return number >= INT8_MIN && number <= INT8_MAX && number == (int8_t) number && !(number == 0 && signbit(number));
 }
 
+static void emitConstant(Value value, uint8_t constant) {
+    if (isSmallInt(value)) {
+        emitBytes(OP_SMALLINT, (uint8_t) (int8_t) AS_NUMBER(value));
+    } else if (constant < SHORT_CONSTANTS) {
+        emitByte(OP_CONSTANT_0 + constant);
+    } else {
+        emitBytes(OP_CONSTANT, constant);
+    }
+    pushType(IS_NUMBER(value) ? TYPE_NUMBER : TYPE_STRING);
+}
+
+static Backend backend = BACKEND_STACK;
+
+void setBackend(Backend selected) {
+    backend = selected;
+}
+
+static void generateCode();
+
+static void generateRegisterCode();
+
 static void endCompiler() {
-    emitReturn();
+    if (backend == BACKEND_REGISTER) {
+        if (!parser.hadError) generateRegisterCode();
+    } else {
+        if (!parser.hadError) generateCode();
+        codeLine = parser.previous.line;
+        emitReturn();
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), "code");
@@ -139,45 +214,342 @@ static void expression();
 
 static ParseRule *getRule(TokenType type);
 
-static void parsePrecedence(Precedence precedence);
+// The operators whose right operand is still being compiled, innermost last. This is the state that
+// used to live on the C stack as nested parsePrecedence() calls.
+typedef enum {
+    OPERATOR_GROUP,
+    OPERATOR_UNARY,
+    OPERATOR_BINARY,
+} OperatorKind;
+
+typedef struct {
+    OperatorKind kind;
+    TokenType type;
+    Precedence precedence;  // infix operators below this precedence end the right operand
+} Operator;
+
+typedef struct {
+    int count;
+    int capacity;
+    Operator *entries;
+} OperatorStack;
+
+static OperatorStack operators;
+static int maxExpressionDepth = DEFAULT_MAX_EXPR_DEPTH;
+
+void setMaxExpressionDepth(int depth) {
+    maxExpressionDepth = depth;
+}
+
+static void pushOperator(OperatorKind kind, TokenType type, Precedence precedence) {
+    if (operators.count >= maxExpressionDepth) {
+        // Keep parsing to find the end of the expression, just without tracking any more nesting.
+        error("Expression nesting is too deep.");
+        return;
+    }
+    if (operators.capacity < operators.count + 1) {
+        int oldCapacity = operators.capacity;
+        operators.capacity = GROW_CAPACITY(oldCapacity);
+        operators.entries = GROW_ARRAY(Operator, operators.entries, oldCapacity, operators.capacity);
+    }
+    Operator *operator = &operators.entries[operators.count++];
+    operator->kind = kind;
+    operator->type = type;
+    operator->precedence = precedence;
+}
+
+/*
+ * The parser does not emit code directly. It builds the expression as a DAG in which structurally equal
+ * subexpressions are hash-consed into the same node, and records the order in which the tree-walking
+ * code would have evaluated them as a list of steps. When a subexpression completes and its node already
+ * exists, its value has been computed by an earlier step: the steps just recorded for it are dropped and
+ * replaced by one step that reloads the saved value. Lox expressions have no side effects, and the first
+ * occurrence always runs first, so results and runtime errors are unchanged.
+ */
+typedef enum {
+    NODE_CONSTANT,
+    NODE_LITERAL,
+    NODE_UNARY,
+    NODE_BINARY,
+} NodeKind;
+
+// Where a reused node keeps its value between being computed and being reloaded.
+#define NO_SLOT (-1)
+#define DUP_SLOT (-2)  // the only reuse comes straight after the computation: OP_DUP is enough
+
+typedef struct {
+    NodeKind kind;
+    TokenType operatorType;  // the operator, or for NODE_LITERAL the keyword
+    int left;  // operand nodes, -1 when absent
+    int right;
+    Value value;  // NODE_CONSTANT only
+    uint8_t constant;
+    uint8_t type;  // StaticType of the result, known once the code computing it has been generated
+    bool shared;  // some step reloads this node
+    int slot;
+    int computedAt;  // the step that computes it
+    int reuses;
+} Node;
+
+typedef struct {
+    int node;
+    bool reuse;
+    int line;
+} Step;
+
+// A completed operand waiting for its operator: its node and the first step that computes it.
+typedef struct {
+    int node;
+    int firstStep;
+} Operand;
+
+// Subtrees shorter than this are cheaper to recompute than to store and reload.
+#define CSE_MIN_STEPS 3
+
+typedef struct {
+    int nodeCount;
+    int nodeCapacity;
+    Node *nodes;
+    int bucketCapacity;
+    int *buckets;  // node index + 1, 0 for an empty bucket
+    int stepCount;
+    int stepCapacity;
+    Step *steps;
+    int operandCount;
+    int operandCapacity;
+    Operand *operands;
+    int sharedCount;
+} ExpressionDag;
+
+ExpressionDag dag;
+
+static uint32_t hashNode(NodeKind kind, TokenType operatorType, int left, int right, Value value) {
+    uint32_t hash = 2166136261u;
+    uint32_t parts[4] = {(uint32_t) kind, (uint32_t) operatorType, (uint32_t) left, (uint32_t) right};
+    for (int i = 0; i < 4; i++) {
+        hash ^= parts[i];
+        hash *= 16777619;
+    }
+    if (kind == NODE_CONSTANT) {
+        // Numbers are compared by bit pattern and strings by their interned ObjString.
+        uint64_t bits = 0;
+        if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            memcpy(&bits, &number, sizeof(bits));
+        } else {
+            bits = (uint64_t) (uintptr_t) AS_OBJ(value);
+        }
+        hash ^= (uint32_t) bits ^ (uint32_t) (bits >> 32);
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static bool nodeMatches(const Node *node, NodeKind kind, TokenType operatorType, int left, int right, Value value) {
+    if (node->kind != kind || node->operatorType != operatorType || node->left != left || node->right != right) {
+        return false;
+    }
+    if (kind != NODE_CONSTANT) return true;
+    if (node->value.type != value.type) return false;
+    if (IS_NUMBER(value)) {
+        return memcmp(&node->value.as.number, &value.as.number, sizeof(double)) == 0;
+    }
+    return AS_OBJ(node->value) == AS_OBJ(value);
+}
+
+static void growBuckets() {
+    int oldCapacity = dag.bucketCapacity;
+    FREE_ARRAY(int, dag.buckets, oldCapacity);
+    dag.bucketCapacity = GROW_CAPACITY(oldCapacity);
+    dag.buckets = ALLOCATE(int, dag.bucketCapacity);
+    memset(dag.buckets, 0, sizeof(int) * dag.bucketCapacity);
+    for (int i = 0; i < dag.nodeCount; i++) {
+        Node *node = &dag.nodes[i];
+        uint32_t index = hashNode(node->kind, node->operatorType, node->left, node->right, node->value)
+                         & (dag.bucketCapacity - 1);
+        while (dag.buckets[index] != 0) index = (index + 1) & (dag.bucketCapacity - 1);
+        dag.buckets[index] = i + 1;
+    }
+}
+
+// Returns the node for this subexpression, creating it if it is new. *existed tells which.
+static int internNode(NodeKind kind, TokenType operatorType, int left, int right, Value value, bool *existed) {
+    if ((dag.nodeCount + 1) * 4 > dag.bucketCapacity * 3) growBuckets();
+    uint32_t index = hashNode(kind, operatorType, left, right, value) & (dag.bucketCapacity - 1);
+    for (;;) {
+        int bucket = dag.buckets[index];
+        if (bucket == 0) break;
+        if (nodeMatches(&dag.nodes[bucket - 1], kind, operatorType, left, right, value)) {
+            *existed = true;
+            return bucket - 1;
+        }
+        index = (index + 1) & (dag.bucketCapacity - 1);
+    }
+
+    if (dag.nodeCapacity < dag.nodeCount + 1) {
+        int oldCapacity = dag.nodeCapacity;
+        dag.nodeCapacity = GROW_CAPACITY(oldCapacity);
+        dag.nodes = GROW_ARRAY(Node, dag.nodes, oldCapacity, dag.nodeCapacity);
+    }
+    Node *node = &dag.nodes[dag.nodeCount];
+    node->kind = kind;
+    node->operatorType = operatorType;
+    node->left = left;
+    node->right = right;
+    node->value = value;
+    node->constant = 0;
+    node->type = TYPE_UNKNOWN;
+    node->shared = false;
+    node->slot = NO_SLOT;
+    node->computedAt = -1;
+    node->reuses = 0;
+    dag.buckets[index] = dag.nodeCount + 1;
+    *existed = false;
+    return dag.nodeCount++;
+}
+
+static void addStep(int node, bool reuse) {
+    if (dag.stepCapacity < dag.stepCount + 1) {
+        int oldCapacity = dag.stepCapacity;
+        dag.stepCapacity = GROW_CAPACITY(oldCapacity);
+        dag.steps = GROW_ARRAY(Step, dag.steps, oldCapacity, dag.stepCapacity);
+    }
+    Step *step = &dag.steps[dag.stepCount++];
+    step->node = node;
+    step->reuse = reuse;
+    step->line = parser.previous.line;
+}
 
+static void pushOperand(int node, int firstStep) {
+    if (dag.operandCapacity < dag.operandCount + 1) {
+        int oldCapacity = dag.operandCapacity;
+        dag.operandCapacity = GROW_CAPACITY(oldCapacity);
+        dag.operands = GROW_ARRAY(Operand, dag.operands, oldCapacity, dag.operandCapacity);
+    }
+    Operand *operand = &dag.operands[dag.operandCount++];
+    operand->node = node;
+    operand->firstStep = firstStep;
+}
+
+// Records that the parser has finished a subexpression whose steps start at firstStep.
+static void completeNode(NodeKind kind, TokenType operatorType, int left, int right, Value value, int firstStep) {
+    bool existed;
+    int node = internNode(kind, operatorType, left, right, value, &existed);
+    // Register code has no OP_SMALLINT: every number is an operand from the constant table.
+    if (kind == NODE_CONSTANT && !existed && (backend == BACKEND_REGISTER || !isSmallInt(value))) {
+        dag.nodes[node].constant = makeConstant(value);
+    }
+
+    addStep(node, false);
+    // Every slot is addressed by a one-byte operand.
+    if (existed && dag.stepCount - firstStep >= CSE_MIN_STEPS &&
+        (dag.nodes[node].shared || dag.sharedCount < UINT8_MAX)) {
+        dag.stepCount = firstStep;
+        addStep(node, true);
+        if (!dag.nodes[node].shared) {
+            dag.nodes[node].shared = true;
+            dag.sharedCount++;
+        }
+    }
+    pushOperand(node, firstStep);
+}
 
+static void leaf(NodeKind kind, TokenType operatorType, Value value) {
+    completeNode(kind, operatorType, -1, -1, value, dag.stepCount);
+}
+
+static void completeUnary(TokenType operatorType) {
+    // After a syntax error the operands may not line up; no code will be generated anyway.
+    if (dag.operandCount < 1) return;
+    Operand operand = dag.operands[--dag.operandCount];
+    completeNode(NODE_UNARY, operatorType, operand.node, -1, NIL_VAL, operand.firstStep);
+}
+
+static void completeBinary(TokenType operatorType) {
+    if (dag.operandCount < 2) return;
+    Operand right = dag.operands[--dag.operandCount];
+    Operand left = dag.operands[--dag.operandCount];
+    completeNode(NODE_BINARY, operatorType, left.node, right.node, NIL_VAL, left.firstStep);
+}
+
+static void freeDag() {
+    FREE_ARRAY(Node, dag.nodes, dag.nodeCapacity);
+    FREE_ARRAY(int, dag.buckets, dag.bucketCapacity);
+    FREE_ARRAY(Step, dag.steps, dag.stepCapacity);
+    FREE_ARRAY(Operand, dag.operands, dag.operandCapacity);
+    memset(&dag, 0, sizeof(dag));
+}
+
+
+// binary() only records the operator. Its node is completed by completeBinary() once the right operand
+// has been parsed, so nothing here recurses.
 static void binary() {
     // When a prefix parser function is called, the leading token has already been consumed.
     TokenType operatorType = parser.previous.type;
     ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence) (rule->precedence + 1));
+    pushOperator(OPERATOR_BINARY, operatorType, (Precedence) (rule->precedence + 1));
+}
 
+// When both operands are proven numbers the unchecked F-form of an instruction is emitted instead.
+// A checked instruction that succeeds still tells us its result type, so proofs flow upwards through
+// unknown operands too: whatever -x is, if it does not fail it is a number.
+static void emitBinary(TokenType operatorType) {
+    StaticType b = popType();
+    StaticType a = popType();
+    bool numbers = a == TYPE_NUMBER && b == TYPE_NUMBER;
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitBytes(numbers ? OP_FEQUAL : OP_EQUAL, OP_NOT);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_EQUAL_EQUAL:
-            emitByte(OP_EQUAL);
+            emitByte(numbers ? OP_FEQUAL : OP_EQUAL);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_GREATER:
-            emitByte(OP_GREATER);
+            emitByte(numbers ? OP_FGREATER : OP_GREATER);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitBytes(OP_LESS, OP_NOT);
+            emitBytes(numbers ? OP_FLESS : OP_LESS, OP_NOT);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_LESS:
-            emitByte(OP_LESS);
+            emitByte(numbers ? OP_FLESS : OP_LESS);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_LESS_EQUAL:
-            emitBytes(OP_GREATER, OP_NOT);
+            emitBytes(numbers ? OP_FGREATER : OP_GREATER, OP_NOT);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            if (numbers) {
+                emitByte(OP_FADD);
+            } else if (a == TYPE_STRING && b == TYPE_STRING) {
+                emitByte(OP_CONCAT);
+            } else {
+                emitByte(OP_ADD);
+            }
+            // A successful + on a number gives a number, on a string a string.
+            if (a == TYPE_NUMBER || b == TYPE_NUMBER) {
+                pushType(TYPE_NUMBER);
+            } else if (a == TYPE_STRING || b == TYPE_STRING) {
+                pushType(TYPE_STRING);
+            } else {
+                pushType(TYPE_UNKNOWN);
+            }
             break;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT);
+            emitByte(numbers ? OP_FSUBTRACT : OP_SUBTRACT);
+            pushType(TYPE_NUMBER);
             break;
         case TOKEN_STAR:
-            emitByte(OP_MULTIPLY);
+            emitByte(numbers ? OP_FMULTIPLY : OP_MULTIPLY);
+            pushType(TYPE_NUMBER);
             break;
         case TOKEN_SLASH:
-            emitByte(OP_DIVIDE);
+            emitByte(numbers ? OP_FDIVIDE : OP_DIVIDE);
+            pushType(TYPE_NUMBER);
             break;
         default:
             return; // Unreachable.
@@ -185,15 +557,22 @@ static void binary() {
 }
 
 static void literal() {
-    switch (parser.previous.type) {
+    leaf(NODE_LITERAL, parser.previous.type, NIL_VAL);
+}
+
+static void emitLiteral(TokenType literalType) {
+    switch (literalType) {
         case TOKEN_FALSE:
             emitByte(OP_FALSE);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_TRUE:
             emitByte(OP_TRUE);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_NIL:
             emitByte(OP_NIL);
+            pushType(TYPE_NIL);
             break;
         default:
             return; // Unreachable.
@@ -203,11 +582,10 @@ static void literal() {
 static void grouping() {
     /*
      * Again, we assume the initial
-     * ( has already been consumed. We recursively call back into expression()
-     * to compile the expression between the parentheses, then parse the closing ) at the end.
+     * ( has already been consumed. The expression between the parentheses is compiled by the main loop
+     * in expression(), which consumes the closing ) when it pops this entry.
      */
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    pushOperator(OPERATOR_GROUP, TOKEN_LEFT_PAREN, PREC_ASSIGNMENT);
 }
 
 /*
@@ -219,15 +597,15 @@ static void grouping() {
 
 //To compile number literals, we store a pointer to the following function at the TOKEN_NUMBER index in the array.
 static void number() {
-    // We assume the token for the number literal has already been consumed and is stored in previous
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    // We assume the token for the number literal has already been consumed and is stored in previous.
+    // The scanner has already worked out its value.
+    leaf(NODE_CONSTANT, TOKEN_NUMBER, NUMBER_VAL(parser.previous.number));
 }
 
 static void string() {
     //  The + 1 and - 2 parts trim the leading and trailing quotation marks. It then creates a string object,
     //  wraps it in a Value, and stuffs it into the constant table.
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    leaf(NODE_CONSTANT, TOKEN_STRING, OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 static void unary() {
@@ -243,44 +621,25 @@ static void unary() {
      * This is part of the compiler’s job—parsing the program in the order it appears in the source code
      * and rearranging it into the order that execution happens.
      */
-    // Compile the operand
-    parsePrecedence(PREC_UNARY);
-    // emit the operator instruction
+    pushOperator(OPERATOR_UNARY, operatorType, PREC_UNARY);
+}
+
+static void emitUnary(TokenType operatorType) {
+    StaticType operand = popType();
     switch (operatorType) {
         case TOKEN_BANG:
             emitByte(OP_NOT);
+            pushType(TYPE_BOOL);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);
+            emitByte(operand == TYPE_NUMBER ? OP_FNEGATE : OP_NEGATE);
+            pushType(TYPE_NUMBER);
             break;
         default:
             return; // Unreachable.
     }
 }
 
-/*
- * That’s the whole thing. Really. Here’s how the entire function works: At the beginning of parsePrecedence(), we look up a prefix parser for the current token. The first token is always going to belong to some kind of prefix expression, by definition. It may turn out to be nested as an operand inside one or more infix expressions, but as you read the code from left to right, the first token you hit always belongs to a prefix expression.
-
-After parsing that, which may consume more tokens, the prefix expression is done. Now we look for an infix parser for the next token. If we find one, it means the prefix expression we already compiled might be an operand for it. But only if the call to parsePrecedence() has a precedence that is low enough to permit that infix operator.
- */
-// https://aandds.com/blog/operator-precedence-parser.html
-static void parsePrecedence(Precedence precedence) {
-    // Let’s start with parsing prefix expressions.
-    advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
-    if (prefixRule == NULL) {
-        error("Expect expression.");
-        return;
-    }
-    prefixRule();
-
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
-    }
-}
-
 ParseRule rules[] = {
         [TOKEN_LEFT_PAREN]    = {grouping, NULL, PREC_NONE},
         [TOKEN_RIGHT_PAREN]   = {NULL, NULL, PREC_NONE},
@@ -329,21 +688,330 @@ static ParseRule *getRule(TokenType type) {
 }
 
 
+/*
+ * This is the Pratt parser from parsePrecedence() with its recursion unrolled onto the operators stack.
+ * In prefix position we read tokens until one of them produces an operand, pushing any prefix operator
+ * or ( on the way. In infix position we look at the next token's precedence: every waiting operator that
+ * does not let an infix operator of that precedence into its right operand is finished, and
+ * if the token is an infix operator that is still allowed in, it is pushed and we go back to prefix position.
+ * Subexpressions complete in exactly the order (and on the same lines) as in the recursive version,
+ * but the C stack stays flat however deeply the input nests.
+ */
 static void expression() {
-    // We simply parse the lowest precedence level, which subsumes all of the higher-precedence expressions too.
-    parsePrecedence(PREC_ASSIGNMENT);
+    int base = operators.count;
+    for (;;) {
+        // Let’s start with parsing prefix expressions.
+        advance();
+        ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+        if (prefixRule == NULL) {
+            error("Expect expression.");
+        } else {
+            int waiting = operators.count;
+            prefixRule();
+            // A prefix operator is still waiting for its operand.
+            if (operators.count > waiting) continue;
+        }
+
+        Precedence precedence = getRule(parser.current.type)->precedence;
+        while (operators.count > base && precedence < operators.entries[operators.count - 1].precedence) {
+            Operator operator = operators.entries[--operators.count];
+            switch (operator.kind) {
+                case OPERATOR_GROUP:
+                    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+                    // The group is now an operand of whatever encloses it.
+                    precedence = getRule(parser.current.type)->precedence;
+                    break;
+                case OPERATOR_UNARY:
+                    completeUnary(operator.type);
+                    break;
+                case OPERATOR_BINARY:
+                    completeBinary(operator.type);
+                    break;
+            }
+        }
+        // The lowest precedence level subsumes all of the higher-precedence expressions too.
+        if (operators.count == base && precedence < PREC_ASSIGNMENT) return;
+
+        advance();
+        ParseFn infixRule = getRule(parser.previous.type)->infix;
+        infixRule();
+    }
+}
+
+// Replays the steps recorded by the parser as bytecode. A shared node is stored into its slot (reserved
+// at the bottom of the stack) right after it is computed, and every later step for it is a load.
+// A node can be marked shared and then have its reuse swallowed by a bigger repeated subexpression, so
+// only the steps that survived count.
+static void countReuses() {
+    for (int i = 0; i < dag.stepCount; i++) {
+        Node *node = &dag.nodes[dag.steps[i].node];
+        if (dag.steps[i].reuse) {
+            node->reuses++;
+        } else if (node->computedAt < 0) {
+            node->computedAt = i;
+        }
+    }
+}
+
+static void generateCode() {
+    int slotCount = 0;
+    countReuses();
+    for (int i = 0; i < dag.nodeCount; i++) {
+        Node *node = &dag.nodes[i];
+        if (node->reuses == 0) continue;
+        int next = node->computedAt + 1;
+        if (node->reuses == 1 && next < dag.stepCount && dag.steps[next].reuse && dag.steps[next].node == i) {
+            node->slot = DUP_SLOT;
+        } else {
+            node->slot = slotCount++;
+        }
+    }
+
+    codeLine = dag.stepCount > 0 ? dag.steps[0].line : parser.previous.line;
+    if (slotCount > 0) {
+        emitBytes(OP_RESERVE, (uint8_t) slotCount);
+        for (int i = 0; i < slotCount; i++) pushType(TYPE_NIL);
+    }
+
+    for (int i = 0; i < dag.stepCount; i++) {
+        Step *step = &dag.steps[i];
+        Node *node = &dag.nodes[step->node];
+        codeLine = step->line;
+        if (step->reuse) {
+            if (node->slot == DUP_SLOT) {
+                emitByte(OP_DUP);
+            } else {
+                emitBytes(OP_LOAD_SLOT, (uint8_t) node->slot);
+            }
+            pushType((StaticType) node->type);
+            continue;
+        }
+
+        switch (node->kind) {
+            case NODE_CONSTANT:
+                emitConstant(node->value, node->constant);
+                break;
+            case NODE_LITERAL:
+                emitLiteral(node->operatorType);
+                break;
+            case NODE_UNARY:
+                emitUnary(node->operatorType);
+                break;
+            case NODE_BINARY:
+                emitBinary(node->operatorType);
+                break;
+        }
+        node->type = types.entries[stackDepth - 1];
+        if (node->slot >= 0) emitBytes(OP_STORE_SLOT, (uint8_t) node->slot);
+    }
+}
+
+// Where the register code generator has put a value: a register or constant operand (see RK_CONSTANT).
+// Temporaries are allocated and freed like a stack, so the live ones are always the highest in use.
+typedef struct {
+    uint8_t operand;
+    bool temporary;
+    uint8_t type;
+} Location;
+
+typedef struct {
+    int count;
+    int capacity;
+    Location *entries;
+} LocationStack;
+
+static LocationStack locations;
+static int nextRegister;  // the first free register
+static int literalConstants[3];  // constant index for false, true and nil, -1 until used
+
+static void pushLocation(uint8_t operand, bool temporary, StaticType type) {
+    if (locations.capacity < locations.count + 1) {
+        int oldCapacity = locations.capacity;
+        locations.capacity = GROW_CAPACITY(oldCapacity);
+        locations.entries = GROW_ARRAY(Location, locations.entries, oldCapacity, locations.capacity);
+    }
+    Location *location = &locations.entries[locations.count++];
+    location->operand = operand;
+    location->temporary = temporary;
+    location->type = type;
+}
+
+static Location popLocation() {
+    Location location = locations.entries[--locations.count];
+    if (location.temporary) nextRegister--;
+    return location;
+}
+
+static uint8_t allocateRegister() {
+    if (nextRegister == RK_CONSTANT) {
+        error("Expression needs too many registers.");
+        return 0;
+    }
+    uint8_t reg = (uint8_t) nextRegister++;
+    if (nextRegister > currentChunk()->maxStack) currentChunk()->maxStack = nextRegister;
+    return reg;
+}
+
+static void emitRegisterOp(uint8_t op, uint8_t dst, uint8_t a, uint8_t b) {
+    emitBytes(op, dst);
+    emitBytes(a, b);
+}
+
+// Puts constant number `constant` where an operand can reach it.
+static void pushConstant(uint8_t constant, StaticType type) {
+    if (constant < 256 - RK_CONSTANT) {
+        pushLocation(RK_CONSTANT + constant, false, type);
+    } else {
+        uint8_t reg = allocateRegister();
+        emitBytes(OP_R_LOADK, reg);
+        emitByte(constant);
+        pushLocation(reg, true, type);
+    }
+}
+
+static StaticType emitRegisterBinary(TokenType operatorType, uint8_t dst, Location a, Location b) {
+    bool numbers = a.type == TYPE_NUMBER && b.type == TYPE_NUMBER;
+    switch (operatorType) {
+        case TOKEN_BANG_EQUAL:
+            emitRegisterOp(numbers ? OP_R_FEQUAL : OP_R_EQUAL, dst, a.operand, b.operand);
+            emitRegisterOp(OP_R_NOT, dst, dst, 0);
+            return TYPE_BOOL;
+        case TOKEN_EQUAL_EQUAL:
+            emitRegisterOp(numbers ? OP_R_FEQUAL : OP_R_EQUAL, dst, a.operand, b.operand);
+            return TYPE_BOOL;
+        case TOKEN_GREATER:
+            emitRegisterOp(numbers ? OP_R_FGREATER : OP_R_GREATER, dst, a.operand, b.operand);
+            return TYPE_BOOL;
+        case TOKEN_GREATER_EQUAL:
+            emitRegisterOp(numbers ? OP_R_FLESS : OP_R_LESS, dst, a.operand, b.operand);
+            emitRegisterOp(OP_R_NOT, dst, dst, 0);
+            return TYPE_BOOL;
+        case TOKEN_LESS:
+            emitRegisterOp(numbers ? OP_R_FLESS : OP_R_LESS, dst, a.operand, b.operand);
+            return TYPE_BOOL;
+        case TOKEN_LESS_EQUAL:
+            emitRegisterOp(numbers ? OP_R_FGREATER : OP_R_GREATER, dst, a.operand, b.operand);
+            emitRegisterOp(OP_R_NOT, dst, dst, 0);
+            return TYPE_BOOL;
+        case TOKEN_PLUS:
+            if (numbers) {
+                emitRegisterOp(OP_R_FADD, dst, a.operand, b.operand);
+            } else if (a.type == TYPE_STRING && b.type == TYPE_STRING) {
+                emitRegisterOp(OP_R_CONCAT, dst, a.operand, b.operand);
+            } else {
+                emitRegisterOp(OP_R_ADD, dst, a.operand, b.operand);
+            }
+            if (a.type == TYPE_NUMBER || b.type == TYPE_NUMBER) return TYPE_NUMBER;
+            if (a.type == TYPE_STRING || b.type == TYPE_STRING) return TYPE_STRING;
+            return TYPE_UNKNOWN;
+        case TOKEN_MINUS:
+            emitRegisterOp(numbers ? OP_R_FSUBTRACT : OP_R_SUBTRACT, dst, a.operand, b.operand);
+            return TYPE_NUMBER;
+        case TOKEN_STAR:
+            emitRegisterOp(numbers ? OP_R_FMULTIPLY : OP_R_MULTIPLY, dst, a.operand, b.operand);
+            return TYPE_NUMBER;
+        case TOKEN_SLASH:
+            emitRegisterOp(numbers ? OP_R_FDIVIDE : OP_R_DIVIDE, dst, a.operand, b.operand);
+            return TYPE_NUMBER;
+        default:
+            return TYPE_UNKNOWN; // Unreachable.
+    }
 }
+
+static StaticType emitRegisterUnary(TokenType operatorType, uint8_t dst, Location operand) {
+    if (operatorType == TOKEN_BANG) {
+        emitRegisterOp(OP_R_NOT, dst, operand.operand, 0);
+        return TYPE_BOOL;
+    }
+    emitRegisterOp(operand.type == TYPE_NUMBER ? OP_R_FNEGATE : OP_R_NEGATE, dst, operand.operand, 0);
+    return TYPE_NUMBER;
+}
+
+static void pushLiteral(TokenType literalType) {
+    int index = literalType == TOKEN_FALSE ? 0 : literalType == TOKEN_TRUE ? 1 : 2;
+    Value value = index == 2 ? NIL_VAL : BOOL_VAL(index == 1);
+    if (literalConstants[index] < 0) literalConstants[index] = makeConstant(value);
+    pushConstant((uint8_t) literalConstants[index], index == 2 ? TYPE_NIL : TYPE_BOOL);
+}
+
+// The register version of generateCode(). A shared node gets a register of its own, below the
+// temporaries, and is computed straight into it; reusing it is then just naming that register.
+static void generateRegisterCode() {
+    Chunk *chunk = currentChunk();
+    chunk->registers = true;
+    nextRegister = 0;
+    for (int i = 0; i < 3; i++) literalConstants[i] = -1;
+    countReuses();
+    for (int i = 0; i < dag.nodeCount; i++) {
+        if (dag.nodes[i].reuses > 0) dag.nodes[i].slot = allocateRegister();
+    }
+
+    for (int i = 0; i < dag.stepCount && !parser.hadError; i++) {
+        Step *step = &dag.steps[i];
+        Node *node = &dag.nodes[step->node];
+        codeLine = step->line;
+        if (step->reuse) {
+            pushLocation((uint8_t) node->slot, false, (StaticType) node->type);
+            continue;
+        }
+
+        StaticType type = TYPE_UNKNOWN;
+        switch (node->kind) {
+            case NODE_CONSTANT:
+                pushConstant(node->constant, IS_NUMBER(node->value) ? TYPE_NUMBER : TYPE_STRING);
+                continue;
+            case NODE_LITERAL:
+                pushLiteral(node->operatorType);
+                continue;
+            case NODE_UNARY: {
+                Location operand = popLocation();
+                uint8_t dst = node->reuses > 0 ? (uint8_t) node->slot : allocateRegister();
+                type = emitRegisterUnary(node->operatorType, dst, operand);
+                pushLocation(dst, node->reuses == 0, type);
+                break;
+            }
+            case NODE_BINARY: {
+                Location b = popLocation();
+                Location a = popLocation();
+                uint8_t dst = node->reuses > 0 ? (uint8_t) node->slot : allocateRegister();
+                type = emitRegisterBinary(node->operatorType, dst, a, b);
+                pushLocation(dst, node->reuses == 0, type);
+                break;
+            }
+        }
+        node->type = type;
+    }
+
+    if (!parser.hadError) {
+        codeLine = parser.previous.line;
+        emitBytes(OP_R_RETURN, locations.entries[locations.count - 1].operand);
+    }
+    FREE_ARRAY(Location, locations.entries, locations.capacity);
+    locations.entries = NULL;
+    locations.count = 0;
+    locations.capacity = 0;
+}
+
 // A compiler has roughly two jobs. It parses the user’s source code to understand what it means.
 // Then it takes that knowledge and outputs low-level instructions that produce the same semantics
-bool compile(const char *source, Chunk *chunk) {
+bool compile(const char *source, size_t length, Chunk *chunk) {
     // tine first phase of compilation is scanning
-    initScanner(source);
+    initScanner(source, length);
     compilingChunk = chunk;
+    stackDepth = 0;
     parser.hadError = false;
     parser.panicMode = false;
     advance();
     expression();
     consume(TOKEN_EOF, "Expected end of expression.");
     endCompiler();
+    freeDag();
+    FREE_ARRAY(Operator, operators.entries, operators.capacity);
+    FREE_ARRAY(uint8_t, types.entries, types.capacity);
+    types.entries = NULL;
+    types.capacity = 0;
+    operators.entries = NULL;
+    operators.count = 0;
+    operators.capacity = 0;
     return !parser.hadError;
 };
\ No newline at end of file
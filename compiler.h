@@ -8,6 +8,19 @@
 #include "object.h"
 #include "vm.h"
 
-bool compile(const char *source, Chunk *chunk);
+// How many unfinished operators and parentheses an expression may nest before compile() reports an error.
+#define DEFAULT_MAX_EXPR_DEPTH 1000000
+
+// Which instruction set compile() produces. Both come from the same parser and expression DAG.
+typedef enum {
+    BACKEND_STACK,     // OP_* instructions for run(), the default
+    BACKEND_REGISTER,  // three-address OP_R_* instructions for runRegisters()
+} Backend;
+
+bool compile(const char *source, size_t length, Chunk *chunk);
+
+void setMaxExpressionDepth(int depth);
+
+void setBackend(Backend backend);
 
 #endif
\ No newline at end of file
@@ -19,6 +19,12 @@ static int simpleInstruction(const char *name, int offset) {
     return offset + 1;
 }
 
+static int byteInstruction(const char *name, const Chunk *chunk, int offset) {
+    uint8_t operand = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, operand);
+    return offset + 2;
+}
+
 static int constantInstruction(const char *name, const Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
@@ -27,6 +33,62 @@ static int constantInstruction(const char *name, const Chunk *chunk, int offset)
     return offset + 2;
 }
 
+static int shortConstantInstruction(const Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset] - OP_CONSTANT_0;
+    printf("OP_CONSTANT_%-4d %4d '", constant, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 1;
+}
+
+static int smallIntInstruction(const Chunk *chunk, int offset) {
+    int8_t value = (int8_t) chunk->code[offset + 1];
+    printf("%-16s %4d\n", "OP_SMALLINT", value);
+    return offset + 2;
+}
+
+// Prints a register operand as r<n> and a constant operand as its value.
+static void printOperand(const Chunk *chunk, uint8_t operand) {
+    if (operand < RK_CONSTANT) {
+        printf(" r%d", operand);
+    } else {
+        printf(" '");
+        printValue(chunk->constants.values[operand - RK_CONSTANT]);
+        printf("'");
+    }
+}
+
+static int registerInstruction(const char *name, const Chunk *chunk, int offset, int operands) {
+    printf("%-16s r%d", name, chunk->code[offset + 1]);
+    for (int i = 0; i < operands; i++) printOperand(chunk, chunk->code[offset + 2 + i]);
+    printf("\n");
+    return offset + 4;
+}
+
+const char *opcodeName(uint8_t instruction) {
+    static const char *const names[] = {
+            [OP_CONSTANT] = "OP_CONSTANT", [OP_NIL] = "OP_NIL", [OP_TRUE] = "OP_TRUE", [OP_FALSE] = "OP_FALSE",
+            [OP_EQUAL] = "OP_EQUAL", [OP_GREATER] = "OP_GREATER", [OP_LESS] = "OP_LESS", [OP_ADD] = "OP_ADD",
+            [OP_SUBTRACT] = "OP_SUBTRACT", [OP_MULTIPLY] = "OP_MULTIPLY", [OP_DIVIDE] = "OP_DIVIDE",
+            [OP_NOT] = "OP_NOT", [OP_NEGATE] = "OP_NEGATE", [OP_RETURN] = "OP_RETURN", [OP_ADD_NUM] = "OP_ADD_NUM",
+            [OP_ADD_STR] = "OP_ADD_STR", [OP_EQUAL_NUM] = "OP_EQUAL_NUM", [OP_FADD] = "OP_FADD",
+            [OP_FSUBTRACT] = "OP_FSUBTRACT", [OP_FMULTIPLY] = "OP_FMULTIPLY", [OP_FDIVIDE] = "OP_FDIVIDE",
+            [OP_FGREATER] = "OP_FGREATER", [OP_FLESS] = "OP_FLESS", [OP_FEQUAL] = "OP_FEQUAL",
+            [OP_FNEGATE] = "OP_FNEGATE", [OP_CONCAT] = "OP_CONCAT", [OP_RESERVE] = "OP_RESERVE",
+            [OP_STORE_SLOT] = "OP_STORE_SLOT", [OP_LOAD_SLOT] = "OP_LOAD_SLOT", [OP_DUP] = "OP_DUP",
+            [OP_SMALLINT] = "OP_SMALLINT", [OP_R_LOADK] = "OP_R_LOADK", [OP_R_ADD] = "OP_R_ADD",
+            [OP_R_SUBTRACT] = "OP_R_SUBTRACT", [OP_R_MULTIPLY] = "OP_R_MULTIPLY", [OP_R_DIVIDE] = "OP_R_DIVIDE",
+            [OP_R_GREATER] = "OP_R_GREATER", [OP_R_LESS] = "OP_R_LESS", [OP_R_EQUAL] = "OP_R_EQUAL",
+            [OP_R_FADD] = "OP_R_FADD", [OP_R_FSUBTRACT] = "OP_R_FSUBTRACT", [OP_R_FMULTIPLY] = "OP_R_FMULTIPLY",
+            [OP_R_FDIVIDE] = "OP_R_FDIVIDE", [OP_R_FGREATER] = "OP_R_FGREATER", [OP_R_FLESS] = "OP_R_FLESS",
+            [OP_R_FEQUAL] = "OP_R_FEQUAL", [OP_R_CONCAT] = "OP_R_CONCAT", [OP_R_NOT] = "OP_R_NOT",
+            [OP_R_NEGATE] = "OP_R_NEGATE", [OP_R_FNEGATE] = "OP_R_FNEGATE", [OP_R_RETURN] = "OP_R_RETURN",
+    };
+    // The short constant loads all count as one.
+    if (instruction >= OP_CONSTANT_0 && instruction <= OP_CONSTANT_15) return "OP_CONSTANT_n";
+    if (instruction >= sizeof(names) / sizeof(names[0]) || names[instruction] == NULL) return "unknown";
+    return names[instruction];
+}
 
 int disassembleInstruction(Chunk *chunk, int offset) {
     // First, it prints the byte offset of the given instruction
@@ -75,7 +137,90 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleInstruction("OP_ADD_STR", offset);
+        case OP_EQUAL_NUM:
+            return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_FADD:
+            return simpleInstruction("OP_FADD", offset);
+        case OP_FSUBTRACT:
+            return simpleInstruction("OP_FSUBTRACT", offset);
+        case OP_FMULTIPLY:
+            return simpleInstruction("OP_FMULTIPLY", offset);
+        case OP_FDIVIDE:
+            return simpleInstruction("OP_FDIVIDE", offset);
+        case OP_FGREATER:
+            return simpleInstruction("OP_FGREATER", offset);
+        case OP_FLESS:
+            return simpleInstruction("OP_FLESS", offset);
+        case OP_FEQUAL:
+            return simpleInstruction("OP_FEQUAL", offset);
+        case OP_FNEGATE:
+            return simpleInstruction("OP_FNEGATE", offset);
+        case OP_CONCAT:
+            return simpleInstruction("OP_CONCAT", offset);
+        case OP_RESERVE:
+            return byteInstruction("OP_RESERVE", chunk, offset);
+        case OP_STORE_SLOT:
+            return byteInstruction("OP_STORE_SLOT", chunk, offset);
+        case OP_LOAD_SLOT:
+            return byteInstruction("OP_LOAD_SLOT", chunk, offset);
+        case OP_DUP:
+            return simpleInstruction("OP_DUP", offset);
+        case OP_SMALLINT:
+            return smallIntInstruction(chunk, offset);
+        case OP_R_LOADK:
+            printf("%-16s r%d", "OP_R_LOADK", chunk->code[offset + 1]);
+            printOperand(chunk, RK_CONSTANT + chunk->code[offset + 2]);
+            printf("\n");
+            return offset + 3;
+        case OP_R_ADD:
+            return registerInstruction("OP_R_ADD", chunk, offset, 2);
+        case OP_R_SUBTRACT:
+            return registerInstruction("OP_R_SUBTRACT", chunk, offset, 2);
+        case OP_R_MULTIPLY:
+            return registerInstruction("OP_R_MULTIPLY", chunk, offset, 2);
+        case OP_R_DIVIDE:
+            return registerInstruction("OP_R_DIVIDE", chunk, offset, 2);
+        case OP_R_GREATER:
+            return registerInstruction("OP_R_GREATER", chunk, offset, 2);
+        case OP_R_LESS:
+            return registerInstruction("OP_R_LESS", chunk, offset, 2);
+        case OP_R_EQUAL:
+            return registerInstruction("OP_R_EQUAL", chunk, offset, 2);
+        case OP_R_FADD:
+            return registerInstruction("OP_R_FADD", chunk, offset, 2);
+        case OP_R_FSUBTRACT:
+            return registerInstruction("OP_R_FSUBTRACT", chunk, offset, 2);
+        case OP_R_FMULTIPLY:
+            return registerInstruction("OP_R_FMULTIPLY", chunk, offset, 2);
+        case OP_R_FDIVIDE:
+            return registerInstruction("OP_R_FDIVIDE", chunk, offset, 2);
+        case OP_R_FGREATER:
+            return registerInstruction("OP_R_FGREATER", chunk, offset, 2);
+        case OP_R_FLESS:
+            return registerInstruction("OP_R_FLESS", chunk, offset, 2);
+        case OP_R_FEQUAL:
+            return registerInstruction("OP_R_FEQUAL", chunk, offset, 2);
+        case OP_R_CONCAT:
+            return registerInstruction("OP_R_CONCAT", chunk, offset, 2);
+        case OP_R_NOT:
+            return registerInstruction("OP_R_NOT", chunk, offset, 1);
+        case OP_R_NEGATE:
+            return registerInstruction("OP_R_NEGATE", chunk, offset, 1);
+        case OP_R_FNEGATE:
+            return registerInstruction("OP_R_FNEGATE", chunk, offset, 1);
+        case OP_R_RETURN:
+            printf("%-16s", "OP_R_RETURN");
+            printOperand(chunk, chunk->code[offset + 1]);
+            printf("\n");
+            return offset + 2;
         default:
+            if (instruction >= OP_CONSTANT_0 && instruction <= OP_CONSTANT_15) {
+                return shortConstantInstruction(chunk, offset);
+            }
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
@@ -9,4 +9,7 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+// "OP_ADD" and so on, for reports that name instructions without disassembling them.
+const char *opcodeName(uint8_t instruction);
+
 #endif
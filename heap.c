@@ -0,0 +1,90 @@
+//
+// Created by neepoo on 23-3-13.
+//
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+
+#define BITMAP_WORDS(slots) (((slots) + 63) / 64)
+
+void initHeap(Heap *heap) {
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) heap->pages[i] = NULL;
+    heap->pageCount = 0;
+    heap->pageBytes = 0;
+    heap->objectCount = 0;
+}
+
+static size_t pageSize(uint32_t slotSize, uint32_t slotCount) {
+    return sizeof(HeapPage) + BITMAP_WORDS(slotCount) * sizeof(uint64_t) + (size_t) slotCount * slotSize;
+}
+
+void freeHeap(Heap *heap) {
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        HeapPage *page = heap->pages[i];
+        while (page != NULL) {
+            HeapPage *next = page->next;
+            REALLOCATE(MEM_OBJECT, page, pageSize(page->slotSize, page->slotCount), 0);
+            page = next;
+        }
+    }
+    initHeap(heap);
+}
+
+// The most slots a page of this size class can have and stay within HEAP_PAGE_BYTES: whole bitmap words,
+// each with its 64 slots.
+static uint32_t maxSlots(uint32_t slotSize) {
+    size_t perWord = sizeof(uint64_t) + 64 * (size_t) slotSize;
+    return (uint32_t) ((HEAP_PAGE_BYTES - sizeof(HeapPage)) / perWord * 64);
+}
+
+static HeapPage *newPage(Heap *heap, int sizeClass) {
+    uint32_t slotSize = (uint32_t) (sizeClass + 1) * HEAP_GRANULE;
+    HeapPage *previous = heap->pages[sizeClass];
+    uint32_t slotCount = previous == NULL ? HEAP_FIRST_SLOTS : previous->slotCount * 2;
+    if (slotCount > maxSlots(slotSize)) slotCount = maxSlots(slotSize);
+
+    size_t bytes = pageSize(slotSize, slotCount);
+    HeapPage *page = (HeapPage *) REALLOCATE(MEM_OBJECT, NULL, 0, bytes);
+    page->next = previous;
+    page->slotSize = slotSize;
+    page->slotCount = slotCount;
+    page->liveCount = 0;
+    page->firstFree = 0;
+    page->live = (uint64_t *) (page + 1);
+    page->slots = (char *) (page->live + BITMAP_WORDS(slotCount));
+    memset(page->live, 0, BITMAP_WORDS(slotCount) * sizeof(uint64_t));
+    heap->pages[sizeClass] = page;
+    heap->pageCount++;
+    heap->pageBytes += bytes;
+    return page;
+}
+
+Obj *heapAllocate(Heap *heap, size_t size) {
+    int sizeClass = (int) ((size + HEAP_GRANULE - 1) / HEAP_GRANULE) - 1;
+    HeapPage *page = heap->pages[sizeClass];
+    // Only the newest page is allocated from. Nothing is freed before the whole heap is, so the pages
+    // behind it are full.
+    if (page == NULL || page->liveCount == page->slotCount) page = newPage(heap, sizeClass);
+
+    uint32_t slot = page->firstFree;
+    while (page->live[slot / 64] & (uint64_t) 1 << slot % 64) slot++;
+    page->live[slot / 64] |= (uint64_t) 1 << slot % 64;
+    page->liveCount++;
+    page->firstFree = slot + 1;
+    heap->objectCount++;
+    return (Obj *) (page->slots + (size_t) slot * page->slotSize);
+}
+
+void walkHeap(Heap *heap, void (*visit)(Obj *object)) {
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        for (HeapPage *page = heap->pages[i]; page != NULL; page = page->next) {
+            for (uint32_t word = 0; word < BITMAP_WORDS(page->slotCount); word++) {
+                uint64_t bits = page->live[word];
+                for (uint32_t slot = word * 64; bits != 0; slot++, bits >>= 1) {
+                    if (bits & 1) visit((Obj *) (page->slots + (size_t) slot * page->slotSize));
+                }
+            }
+        }
+    }
+}
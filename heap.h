@@ -0,0 +1,57 @@
+//
+// Created by neepoo on 23-3-13.
+//
+
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value.h"
+
+// Objects are grouped by size, rounded up to 8 bytes; every object struct fits in the largest class.
+#define HEAP_GRANULE 8
+#define HEAP_SIZE_CLASSES 16
+#define HEAP_MAX_OBJECT (HEAP_GRANULE * HEAP_SIZE_CLASSES)
+
+// A class's first page has room for HEAP_FIRST_SLOTS objects and each new page twice as many as the
+// last, up to HEAP_PAGE_BYTES, so a short run does not pay for a full page per class.
+#define HEAP_FIRST_SLOTS 32
+#define HEAP_PAGE_BYTES (64 * 1024)
+
+/*
+ * A page of same-sized slots. Which slots hold an object is kept on the side, one bit per slot in live,
+ * rather than in the objects themselves: an object needs no header field for it, and a walk over the
+ * heap reads the bitmap a word at a time and touches only the slots in use, in address order.
+ */
+typedef struct HeapPage {
+    struct HeapPage *next;  // the class's other pages, newest first
+    uint32_t slotSize;
+    uint32_t slotCount;
+    uint32_t liveCount;
+    uint32_t firstFree;  // no slot below this one is free
+    uint64_t *live;  // slotCount bits, right after the header
+    char *slots;  // slotCount * slotSize bytes, after the bitmap
+} HeapPage;
+
+typedef struct {
+    HeapPage *pages[HEAP_SIZE_CLASSES];  // per class; the first page is the one allocated from
+    size_t pageCount;
+    size_t pageBytes;  // all pages, headers and bitmaps included
+    size_t objectCount;
+} Heap;
+
+void initHeap(Heap *heap);
+
+// Frees every page without looking at the objects in them; walk the heap first if they own memory.
+void freeHeap(Heap *heap);
+
+// Uninitialised room for an object of size bytes (at most HEAP_MAX_OBJECT). Pages come from reallocate(),
+// so they count against the heap limit and a page that cannot be had ends in outOfMemory().
+Obj *heapAllocate(Heap *heap, size_t size);
+
+// Calls visit on every object in the heap.
+void walkHeap(Heap *heap, void (*visit)(Obj *object));
+
+#endif
@@ -0,0 +1,490 @@
+//
+// Created by neepoo on 23-3-2.
+//
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define IMAGE_MAGIC "cloximg"
+// Bumped whenever the layout below or the instruction set changes.
+#define IMAGE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t valueSize;  // guards against loading an image from a build with a different Value
+    uint32_t stringCount;
+    uint32_t chunkCount;
+    uint64_t stringsOffset;  // ImageString[stringCount]
+    uint64_t chunksOffset;   // ImageChunk[chunkCount]
+    uint64_t size;
+} ImageHeader;
+
+typedef struct {
+    uint64_t charsOffset;  // length bytes followed by a '\0'
+    uint32_t length;
+    uint32_t hash;
+} ImageString;
+
+typedef struct {
+    uint32_t type;  // a ValueType
+    uint32_t string;  // index of the string, for VAL_OBJ
+    double number;  // the number, or for VAL_BOOL 0 or 1
+} ImageConstant;
+
+typedef struct {
+    uint64_t codeOffset;
+    uint64_t linesOffset;  // int32_t[count]
+    uint64_t constantsOffset;  // ImageConstant[constantCount]
+    uint32_t source;  // index of the string holding the source text
+    uint32_t count;
+    uint32_t constantCount;
+    int32_t maxStack;
+    uint32_t registers;
+    uint32_t padding;
+} ImageChunk;
+
+void initImage(Image *image) {
+    image->mapping = NULL;
+    image->size = 0;
+    image->strings = NULL;
+    image->stringCount = 0;
+    image->chunks = NULL;
+    image->chunkCount = 0;
+    initTable(&image->sources);
+}
+
+// ---- Saving ----
+
+// Appends bytes to an in-memory writer and returns the offset they start at, 8-byte aligned.
+static uint64_t append(Writer *out, const void *bytes, size_t length) {
+    static const char zeros[8] = {0};
+    if (out->count % 8 != 0) writeChars(out, zeros, 8 - out->count % 8);
+    uint64_t offset = (uint64_t) out->count;
+    writeChars(out, (const char *) bytes, (int) length);
+    return offset;
+}
+
+static uint32_t stringIndex(Table *indices, ObjString *string) {
+    Value index;
+    tableGet(indices, string, &index);
+    return (uint32_t) AS_NUMBER(index);
+}
+
+bool saveImage(const char *path, Chunk *chunks, const char **sources, const size_t *lengths, int count) {
+    // Interning the sources first puts them in vm.strings with everything else.
+    ObjString **sourceStrings = ALLOCATE(ObjString *, count);
+    for (int i = 0; i < count; i++) sourceStrings[i] = copyString(sources[i], (int) lengths[i]);
+
+    Writer out;
+    initWriter(&out, NULL);
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    append(&out, &header, sizeof(header));
+
+    // Strings: characters first, then the table describing them.
+    Table indices;
+    initTable(&indices);
+    int stringCount = 0;
+    ImageString *strings = ALLOCATE(ImageString, vm.strings.count);
+    for (int i = 0; i < vm.strings.capacity; i++) {
+        ObjString *string = vm.strings.entries[i].key;
+        if (string == NULL) continue;
+        strings[stringCount].charsOffset = append(&out, string->chars, (size_t) string->length + 1);
+        strings[stringCount].length = (uint32_t) string->length;
+        strings[stringCount].hash = string->hash;
+        tableSet(&indices, string, NUMBER_VAL(stringCount));
+        stringCount++;
+    }
+    header.stringsOffset = append(&out, strings, sizeof(ImageString) * stringCount);
+    header.stringCount = (uint32_t) stringCount;
+    FREE_ARRAY(ImageString, strings, vm.strings.count);
+
+    ImageChunk *images = ALLOCATE(ImageChunk, count);
+    for (int i = 0; i < count; i++) {
+        Chunk *chunk = &chunks[i];
+        ImageChunk *image = &images[i];
+        memset(image, 0, sizeof(*image));
+        image->source = stringIndex(&indices, sourceStrings[i]);
+        image->count = (uint32_t) chunk->count;
+        image->constantCount = (uint32_t) chunk->constants.count;
+        image->maxStack = chunk->maxStack;
+        image->registers = chunk->registers;
+        image->codeOffset = append(&out, chunk->code, (size_t) chunk->count);
+        image->linesOffset = append(&out, chunk->lines, sizeof(int) * chunk->count);
+
+        ImageConstant *constants = ALLOCATE(ImageConstant, chunk->constants.count);
+        for (int j = 0; j < chunk->constants.count; j++) {
+            Value value = chunk->constants.values[j];
+            constants[j].type = value.type;
+            constants[j].string = IS_OBJ(value) ? stringIndex(&indices, AS_STRING(value)) : 0;
+            constants[j].number = IS_NUMBER(value) ? AS_NUMBER(value) : IS_BOOL(value) ? AS_BOOL(value) : 0;
+        }
+        image->constantsOffset = append(&out, constants, sizeof(ImageConstant) * chunk->constants.count);
+        FREE_ARRAY(ImageConstant, constants, chunk->constants.count);
+    }
+    header.chunksOffset = append(&out, images, sizeof(ImageChunk) * count);
+    header.chunkCount = (uint32_t) count;
+    FREE_ARRAY(ImageChunk, images, count);
+    FREE_ARRAY(ObjString *, sourceStrings, count);
+    freeTable(&indices);
+
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.valueSize = sizeof(Value);
+    header.size = (uint64_t) out.count;
+    memcpy(out.chars, &header, sizeof(header));
+
+    FILE *file = fopen(path, "wb");
+    bool written = file != NULL && fwrite(out.chars, 1, (size_t) out.count, file) == (size_t) out.count;
+    if (file != NULL && fclose(file) != 0) written = false;
+    if (!written) fprintf(stderr, "Could not write image \"%s\".\n", path);
+    freeWriter(&out);
+    return written;
+}
+
+// ---- Loading ----
+
+// Whether [offset, offset + length) lies inside the image, starting where append() would have put it.
+static bool inImage(const Image *image, uint64_t offset, uint64_t length) {
+    return offset % 8 == 0 && offset <= image->size && length <= image->size - offset;
+}
+
+static bool loadStrings(Image *image, const ImageHeader *header) {
+    const char *base = (const char *) image->mapping;
+    if (!inImage(image, header->stringsOffset, (uint64_t) header->stringCount * sizeof(ImageString))) return false;
+    const ImageString *strings = (const ImageString *) (base + header->stringsOffset);
+
+    image->strings = ALLOCATE(ObjString, header->stringCount);
+    image->stringCount = (int) header->stringCount;
+    if (image->stringCount > 0) memset(image->strings, 0, sizeof(ObjString) * header->stringCount);
+    for (int i = 0; i < image->stringCount; i++) {
+        // The characters are printed with printf("%s") too, so the '\0' has to be there.
+        if (!inImage(image, strings[i].charsOffset, (uint64_t) strings[i].length + 1) ||
+            base[strings[i].charsOffset + strings[i].length] != '\0') {
+            return false;
+        }
+        // Image strings belong to the image, so like arena strings they stay out of vm.heap.
+        ObjString *string = &image->strings[i];
+        string->obj.type = OBJ_STRING;
+        string->length = (int) strings[i].length;
+        string->chars = (char *) base + strings[i].charsOffset;
+        string->hash = strings[i].hash;
+        tableSet(&vm.strings, string, NIL_VAL);
+    }
+    return true;
+}
+
+/*
+ * The interpreter and the JIT trust the code the compiler wrote: operands index the constants, the saved
+ * slots and the registers unchecked, and the unchecked instructions (OP_FADD, OP_CONCAT, ...) assume the
+ * operand types the compiler proved. Code from a file has not been through the compiler, so it is checked
+ * here the way the compiler would have built it, in one walk: every instruction known and complete, every
+ * operand in range, the stack never below empty or above maxStack, registers written before they are read,
+ * the types the unchecked instructions rely on, and a return at the end and nowhere else.
+ */
+typedef enum {
+    KNOWN_UNDEFINED,  // a register nothing has written yet
+    KNOWN_NOTHING,
+    KNOWN_NUMBER,
+    KNOWN_STRING,
+    KNOWN_BOOL,
+    KNOWN_NIL,
+} Known;
+
+static Known knownValue(Value value) {
+    if (IS_NUMBER(value)) return KNOWN_NUMBER;
+    if (IS_STRING(value)) return KNOWN_STRING;
+    if (IS_BOOL(value)) return KNOWN_BOOL;
+    return KNOWN_NIL;
+}
+
+// What an instruction leaves, given its operands, as the compiler works it out; KNOWN_UNDEFINED if the
+// operands are not what the instruction needs. b is ignored by unary instructions.
+static Known knownResult(uint8_t instruction, Known a, Known b) {
+    bool numbers = a == KNOWN_NUMBER && b == KNOWN_NUMBER;
+    switch (instruction) {
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_NOT:
+        case OP_R_GREATER:
+        case OP_R_LESS:
+        case OP_R_EQUAL:
+        case OP_R_NOT:
+            return KNOWN_BOOL;
+        case OP_FGREATER:
+        case OP_FLESS:
+        case OP_FEQUAL:
+        case OP_R_FGREATER:
+        case OP_R_FLESS:
+        case OP_R_FEQUAL:
+            return numbers ? KNOWN_BOOL : KNOWN_UNDEFINED;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_NEGATE:
+            return KNOWN_NUMBER;
+        case OP_FADD:
+        case OP_FSUBTRACT:
+        case OP_FMULTIPLY:
+        case OP_FDIVIDE:
+        case OP_R_FADD:
+        case OP_R_FSUBTRACT:
+        case OP_R_FMULTIPLY:
+        case OP_R_FDIVIDE:
+            return numbers ? KNOWN_NUMBER : KNOWN_UNDEFINED;
+        case OP_FNEGATE:
+        case OP_R_FNEGATE:
+            return a == KNOWN_NUMBER ? KNOWN_NUMBER : KNOWN_UNDEFINED;
+        case OP_CONCAT:
+        case OP_R_CONCAT:
+            return a == KNOWN_STRING && b == KNOWN_STRING ? KNOWN_STRING : KNOWN_UNDEFINED;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_R_ADD:
+            // Anything but two numbers or two strings is a runtime error.
+            if (a == KNOWN_NUMBER || b == KNOWN_NUMBER) return KNOWN_NUMBER;
+            if (a == KNOWN_STRING || b == KNOWN_STRING) return KNOWN_STRING;
+            return KNOWN_NOTHING;
+        default:
+            return KNOWN_UNDEFINED;
+    }
+}
+
+static bool isUnary(uint8_t instruction) {
+    return instruction == OP_NOT || instruction == OP_NEGATE || instruction == OP_FNEGATE;
+}
+
+static bool verifyStackCode(const Chunk *chunk) {
+    // Each byte pushes at most one value, apart from OP_RESERVE's; a bigger maxStack would only make
+    // ensureStack() ask for memory the code can never use.
+    if (chunk->maxStack > chunk->count + UINT8_MAX) return false;
+    Known *stack = ALLOCATE(Known, chunk->maxStack + 1);
+    Known slots[UINT8_MAX];
+    int depth = 0;
+    int slotCount = -1;  // until OP_RESERVE
+    bool valid = false;
+    int offset = 0;
+    while (offset < chunk->count) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction > OP_CONSTANT_15 || offset + instructionLength(instruction) > chunk->count) break;
+        uint8_t operand = instructionLength(instruction) > 1 ? chunk->code[offset + 1] : 0;
+        offset += instructionLength(instruction);
+        Known pushed = KNOWN_UNDEFINED;
+        switch (instruction) {
+            case OP_CONSTANT:
+                if (operand < chunk->constants.count) pushed = knownValue(chunk->constants.values[operand]);
+                break;
+            case OP_NIL:
+                pushed = KNOWN_NIL;
+                break;
+            case OP_TRUE:
+            case OP_FALSE:
+                pushed = KNOWN_BOOL;
+                break;
+            case OP_SMALLINT:
+                pushed = KNOWN_NUMBER;
+                break;
+            case OP_RESERVE:
+                // Only first: the saved values are the bottom of the stack.
+                if (slotCount != -1 || depth != 0 || operand > chunk->maxStack) break;
+                slotCount = operand;
+                for (int i = 0; i < slotCount; i++) stack[depth++] = slots[i] = KNOWN_NIL;
+                continue;
+            case OP_STORE_SLOT:
+                if (operand >= slotCount || depth == 0) break;
+                slots[operand] = stack[depth - 1];
+                continue;
+            case OP_LOAD_SLOT:
+                if (operand < slotCount) pushed = slots[operand];
+                break;
+            case OP_DUP:
+                if (depth > 0) pushed = stack[depth - 1];
+                break;
+            case OP_RETURN:
+                valid = depth > 0 && offset == chunk->count;
+                break;
+            CASE_SHORT_CONSTANTS:
+                if (instruction - OP_CONSTANT_0 < chunk->constants.count) {
+                    pushed = knownValue(chunk->constants.values[instruction - OP_CONSTANT_0]);
+                }
+                break;
+            default: {
+                int operands = isUnary(instruction) ? 1 : 2;
+                if (depth < operands) break;
+                depth -= operands;
+                pushed = knownResult(instruction, stack[depth], operands == 2 ? stack[depth + 1] : KNOWN_NOTHING);
+                break;
+            }
+        }
+        if (instruction == OP_RETURN || pushed == KNOWN_UNDEFINED || depth == chunk->maxStack) break;
+        stack[depth++] = pushed;
+    }
+    FREE_ARRAY(Known, stack, chunk->maxStack + 1);
+    return valid;
+}
+
+// What a register operand reads: a register that has been written, or a constant.
+static Known readOperand(const Chunk *chunk, const Known *registers, uint8_t operand) {
+    if (operand >= RK_CONSTANT) {
+        int constant = operand - RK_CONSTANT;
+        return constant < chunk->constants.count ? knownValue(chunk->constants.values[constant]) : KNOWN_UNDEFINED;
+    }
+    return operand < chunk->maxStack ? registers[operand] : KNOWN_UNDEFINED;
+}
+
+static bool verifyRegisterCode(const Chunk *chunk) {
+    if (chunk->maxStack > RK_CONSTANT) return false;
+    Known registers[RK_CONSTANT];
+    for (int i = 0; i < chunk->maxStack; i++) registers[i] = KNOWN_UNDEFINED;
+    int offset = 0;
+    while (offset < chunk->count) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction < OP_R_LOADK || instruction > OP_R_RETURN ||
+            offset + instructionLength(instruction) > chunk->count) {
+            return false;
+        }
+        const uint8_t *operands = &chunk->code[offset + 1];
+        offset += instructionLength(instruction);
+        if (instruction == OP_R_RETURN) {
+            return readOperand(chunk, registers, operands[0]) != KNOWN_UNDEFINED && offset == chunk->count;
+        }
+        if (operands[0] >= chunk->maxStack) return false;
+        Known result;
+        if (instruction == OP_R_LOADK) {
+            result = operands[1] < chunk->constants.count ? knownValue(chunk->constants.values[operands[1]])
+                                                          : KNOWN_UNDEFINED;
+        } else {
+            Known a = readOperand(chunk, registers, operands[1]);
+            Known b = readOperand(chunk, registers, operands[2]);
+            // A unary instruction's second operand is read but not used, so it only has to be in range.
+            bool unary = instruction == OP_R_NOT || instruction == OP_R_NEGATE || instruction == OP_R_FNEGATE;
+            if (unary && b == KNOWN_UNDEFINED && operands[2] < chunk->maxStack) b = KNOWN_NOTHING;
+            result = a == KNOWN_UNDEFINED || b == KNOWN_UNDEFINED ? KNOWN_UNDEFINED : knownResult(instruction, a, b);
+        }
+        if (result == KNOWN_UNDEFINED) return false;
+        registers[operands[0]] = result;
+    }
+    return false;
+}
+
+static bool loadChunk(Image *image, const ImageChunk *stored, Chunk *chunk) {
+    char *base = (char *) image->mapping;
+    if (!inImage(image, stored->codeOffset, stored->count) ||
+        !inImage(image, stored->linesOffset, (uint64_t) stored->count * sizeof(int)) ||
+        !inImage(image, stored->constantsOffset, (uint64_t) stored->constantCount * sizeof(ImageConstant)) ||
+        stored->source >= (uint32_t) image->stringCount) {
+        return false;
+    }
+
+    // The mapping is private and writable, so quickening rewrites the code copy-on-write.
+    chunk->code = (uint8_t *) base + stored->codeOffset;
+    chunk->lines = (int *) (base + stored->linesOffset);
+    chunk->count = (int) stored->count;
+    chunk->capacity = chunk->count;
+    chunk->maxStack = stored->maxStack;
+    chunk->registers = stored->registers != 0;
+
+    const ImageConstant *constants = (const ImageConstant *) (base + stored->constantsOffset);
+    for (uint32_t i = 0; i < stored->constantCount; i++) {
+        Value value;
+        switch (constants[i].type) {
+            case VAL_BOOL:
+                value = BOOL_VAL(constants[i].number != 0);
+                break;
+            case VAL_NIL:
+                value = NIL_VAL;
+                break;
+            case VAL_NUMBER:
+                value = NUMBER_VAL(constants[i].number);
+                break;
+            case VAL_OBJ:
+                if (constants[i].string >= (uint32_t) image->stringCount) return false;
+                value = OBJ_VAL(&image->strings[constants[i].string]);
+                break;
+            default:
+                return false;
+        }
+        writeValueArray(&chunk->constants, value);
+    }
+    if (chunk->count == 0 || chunk->maxStack < 0) return false;
+    return chunk->registers ? verifyRegisterCode(chunk) : verifyStackCode(chunk);
+}
+
+bool loadImage(Image *image, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(ImageHeader)) {
+        fprintf(stderr, "Could not open image \"%s\".\n", path);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *mapping = mmap(NULL, (size_t) info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Could not map image \"%s\".\n", path);
+        return false;
+    }
+    image->mapping = mapping;
+    image->size = (size_t) info.st_size;
+
+    const ImageHeader *header = (const ImageHeader *) mapping;
+    bool valid = memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == IMAGE_VERSION && header->valueSize == sizeof(Value) &&
+                 header->size == image->size && loadStrings(image, header) &&
+                 inImage(image, header->chunksOffset, (uint64_t) header->chunkCount * sizeof(ImageChunk));
+    if (valid) {
+        const ImageChunk *chunks = (const ImageChunk *) ((char *) mapping + header->chunksOffset);
+        image->chunks = ALLOCATE(Chunk, header->chunkCount);
+        image->chunkCount = (int) header->chunkCount;
+        for (int i = 0; i < image->chunkCount; i++) initChunk(&image->chunks[i]);
+        for (int i = 0; i < image->chunkCount && valid; i++) {
+            valid = loadChunk(image, &chunks[i], &image->chunks[i]);
+            if (valid) tableSet(&image->sources, &image->strings[chunks[i].source], NUMBER_VAL(i));
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "\"%s\" is not an image from this version of clox.\n", path);
+        for (int i = 0; i < image->stringCount; i++) tableDelete(&vm.strings, &image->strings[i]);
+        freeImage(image);
+    }
+    return valid;
+}
+
+void freeImage(Image *image) {
+    for (int i = 0; i < image->chunkCount; i++) {
+        // Code and lines are part of the mapping; only the constants were allocated.
+        freeValueArray(&image->chunks[i].constants);
+        jitFree(&image->chunks[i]);
+    }
+    FREE_ARRAY(Chunk, image->chunks, image->chunkCount);
+    FREE_ARRAY(ObjString, image->strings, image->stringCount);
+    freeTable(&image->sources);
+    if (image->mapping != NULL) munmap(image->mapping, image->size);
+    initImage(image);
+}
+
+Chunk *findPreloadedChunk(Image *image, const char *source, size_t length) {
+    if (image->sources.count == 0) return NULL;
+    ObjString *key = tableFindString(&image->sources, source, (int) length, hashString(source, (int) length));
+    if (key == NULL) return NULL;
+    Value index;
+    tableGet(&image->sources, key, &index);
+    return &image->chunks[(int) AS_NUMBER(index)];
+}
@@ -0,0 +1,44 @@
+//
+// Created by neepoo on 23-3-2.
+//
+
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "chunk.h"
+#include "table.h"
+
+/*
+ * A heap image: the interned strings and a set of compiled chunks, saved so a later process can start
+ * with them instead of scanning and compiling again. Inside the file everything refers to everything
+ * else by offset or index, so it can be mapped at any address. Loading maps it privately and only
+ * builds what has to hold real pointers: an ObjString per string, whose characters stay in the mapping,
+ * and each chunk's constants. Code and line arrays are used where they lie.
+ *
+ * Each chunk is stored with its source text. interpretLength() runs the preloaded chunk instead of
+ * compiling when it is given exactly that text.
+ */
+typedef struct {
+    void *mapping;
+    size_t size;
+    ObjString *strings;
+    int stringCount;
+    Chunk *chunks;
+    int chunkCount;
+    Table sources;  // source text -> index into chunks, as a number
+} Image;
+
+void initImage(Image *image);
+
+// Writes vm.strings and the given chunks, which were compiled from sources[i] (lengths[i] bytes).
+bool saveImage(const char *path, Chunk *chunks, const char **sources, const size_t *lengths, int count);
+
+// Maps the image at path and interns its strings into vm.strings. Reports any problem on stderr.
+bool loadImage(Image *image, const char *path);
+
+void freeImage(Image *image);
+
+// The preloaded chunk for this source, or NULL.
+Chunk *findPreloadedChunk(Image *image, const char *source, size_t length);
+
+#endif
@@ -0,0 +1,373 @@
+//
+// Created by neepoo on 23-2-20.
+//
+#include "jit.h"
+
+#ifdef JIT_AVAILABLE
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+
+/*
+ * The generated code keeps the VM stack in memory, exactly as run() leaves it, so the VM can take over
+ * at any instruction:
+ *   rbx  points one past the top value (vm.stackTop)
+ *   r12  the frame, where OP_RESERVE's saved values start
+ * A Value is 16 bytes: the type in the first 4, the payload at offset 8. So the top value's type is at
+ * [rbx-16] and its payload at [rbx-8], the one below it at [rbx-32] and [rbx-24].
+ */
+typedef InterpretResult (*NativeCode)(Value *stackTop);
+
+typedef struct {
+    uint8_t *code;
+    int count;
+    int capacity;
+    int *errorJumps;  // rel32 fields still to be pointed at the error exit
+    int errorCount;
+    int errorCapacity;
+} Assembler;
+
+static void emitCode(Assembler *as, const uint8_t *bytes, int length) {
+    if (as->capacity < as->count + length) {
+        int oldCapacity = as->capacity;
+        while (as->capacity < as->count + length) as->capacity = GROW_CAPACITY(as->capacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    memcpy(as->code + as->count, bytes, length);
+    as->count += length;
+}
+
+#define EMIT(...) emitCode(as, (const uint8_t[]) {__VA_ARGS__}, sizeof((const uint8_t[]) {__VA_ARGS__}))
+
+// x86-64 is little-endian, like the host we are running on.
+static void emit32(Assembler *as, uint32_t value) {
+    emitCode(as, (const uint8_t *) &value, sizeof(value));
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+    emitCode(as, (const uint8_t *) &value, sizeof(value));
+}
+
+// Leaves room for a jump's rel32 and returns where it is, to be filled in by patchJump().
+static int emitHole(Assembler *as) {
+    int hole = as->count;
+    emit32(as, 0);
+    return hole;
+}
+
+static void patchJump(Assembler *as, int hole) {
+    int32_t distance = as->count - (hole + 4);
+    memcpy(as->code + hole, &distance, sizeof(distance));
+}
+
+static void jumpToError(Assembler *as) {
+    EMIT(0x0F, 0x84);  // jz rel32
+    if (as->errorCapacity < as->errorCount + 1) {
+        int oldCapacity = as->errorCapacity;
+        as->errorCapacity = GROW_CAPACITY(oldCapacity);
+        as->errorJumps = GROW_ARRAY(int, as->errorJumps, oldCapacity, as->errorCapacity);
+    }
+    as->errorJumps[as->errorCount++] = emitHole(as);
+}
+
+static void emitEpilogue(Assembler *as) {
+    EMIT(0x41, 0x5D,   // pop r13
+         0x41, 0x5C,   // pop r12
+         0x5B,         // pop rbx
+         0xC3);        // ret
+}
+
+static void emitPush(Assembler *as, Value value) {
+    uint64_t payload = 0;
+    if (IS_BOOL(value)) {
+        payload = AS_BOOL(value);
+    } else if (!IS_NIL(value)) {
+        memcpy(&payload, &value.as, sizeof(payload));
+    }
+    EMIT(0xC7, 0x03);  // mov dword [rbx], type
+    emit32(as, value.type);
+    EMIT(0x48, 0xB8);  // mov rax, payload
+    emit64(as, payload);
+    EMIT(0x48, 0x89, 0x43, 0x08,   // mov [rbx+8], rax
+         0x48, 0x83, 0xC3, 0x10);  // add rbx, 16
+}
+
+// Hands the instruction at ip to the VM, which reports any runtime error itself.
+static void emitSlowPath(Assembler *as, const uint8_t *ip) {
+    EMIT(0x48, 0x89, 0xDF,   // mov rdi, rbx
+         0x4C, 0x89, 0xE6);  // mov rsi, r12
+    EMIT(0x48, 0xBA);        // mov rdx, ip
+    emit64(as, (uint64_t) (uintptr_t) ip);
+    EMIT(0x48, 0xB8);        // mov rax, runSlowPath
+    emit64(as, (uint64_t) (uintptr_t) runSlowPath);
+    EMIT(0xFF, 0xD0,         // call rax
+         0x48, 0x85, 0xC0);  // test rax, rax
+    jumpToError(as);
+    EMIT(0x48, 0x89, 0xC3);  // mov rbx, rax
+}
+
+// The start of an instruction that only has inline code for numbers: jumps to the slow path, filled in
+// by endChecked(), unless the top `operands` values are all numbers.
+static void beginChecked(Assembler *as, int operands, int *slowJumps) {
+    for (int i = 0; i < operands; i++) {
+        EMIT(0x83, 0x7B, (uint8_t) (-16 * (operands - i)), VAL_NUMBER,  // cmp dword [rbx-disp], VAL_NUMBER
+             0x0F, 0x85);                                                 // jne rel32
+        slowJumps[i] = emitHole(as);
+    }
+}
+
+static void endChecked(Assembler *as, const uint8_t *ip, const int *slowJumps, int operands) {
+    EMIT(0xE9);  // jmp rel32, over the slow path
+    int done = emitHole(as);
+    for (int i = 0; i < operands; i++) patchJump(as, slowJumps[i]);
+    emitSlowPath(as, ip);
+    patchJump(as, done);
+}
+
+// sseOpcode is the second opcode byte of addsd, subsd, mulsd or divsd.
+static void emitArithmetic(Assembler *as, uint8_t sseOpcode) {
+    EMIT(0xF2, 0x0F, 0x10, 0x43, 0xE8,        // movsd xmm0, [rbx-24]
+         0xF2, 0x0F, sseOpcode, 0x43, 0xF8,   // op xmm0, [rbx-8]
+         0xF2, 0x0F, 0x11, 0x43, 0xE8,        // movsd [rbx-24], xmm0
+         0x48, 0x83, 0xEB, 0x10);             // sub rbx, 16
+}
+
+// Compares the two numbers on top and replaces them with a bool. An unordered comparison (a NaN operand)
+// comes out false, as it does in C.
+static void emitComparison(Assembler *as, OpCode comparison) {
+    switch (comparison) {
+        case OP_GREATER:
+            EMIT(0xF2, 0x0F, 0x10, 0x43, 0xE8,   // movsd xmm0, [rbx-24]
+                 0x66, 0x0F, 0x2E, 0x43, 0xF8,   // ucomisd xmm0, [rbx-8]
+                 0x0F, 0x97, 0xC0);              // seta al
+            break;
+        case OP_LESS:
+            EMIT(0xF2, 0x0F, 0x10, 0x43, 0xF8,   // movsd xmm0, [rbx-8]
+                 0x66, 0x0F, 0x2E, 0x43, 0xE8,   // ucomisd xmm0, [rbx-24]
+                 0x0F, 0x97, 0xC0);              // seta al
+            break;
+        default:
+            EMIT(0xF2, 0x0F, 0x10, 0x43, 0xE8,   // movsd xmm0, [rbx-24]
+                 0x66, 0x0F, 0x2E, 0x43, 0xF8,   // ucomisd xmm0, [rbx-8]
+                 0x0F, 0x94, 0xC0,               // sete al
+                 0x0F, 0x9B, 0xC1,               // setnp cl
+                 0x20, 0xC8);                    // and al, cl
+            break;
+    }
+    EMIT(0x0F, 0xB6, 0xC0,               // movzx eax, al
+         0x48, 0x89, 0x43, 0xE8,         // mov [rbx-24], rax
+         0xC7, 0x43, 0xE0);              // mov dword [rbx-32], VAL_BOOL
+    emit32(as, VAL_BOOL);
+    EMIT(0x48, 0x83, 0xEB, 0x10);        // sub rbx, 16
+}
+
+static void emitNegate(Assembler *as) {
+    EMIT(0x48, 0x8B, 0x43, 0xF8,         // mov rax, [rbx-8]
+         0x48, 0x0F, 0xBA, 0xF8, 0x3F,   // btc rax, 63
+         0x48, 0x89, 0x43, 0xF8);        // mov [rbx-8], rax
+}
+
+static void emitChecked(Assembler *as, const uint8_t *ip, OpCode generic) {
+    int slowJumps[2];
+    int operands = generic == OP_NEGATE ? 1 : 2;
+    beginChecked(as, operands, slowJumps);
+    switch (generic) {
+        case OP_ADD:
+            emitArithmetic(as, 0x58);
+            break;
+        case OP_SUBTRACT:
+            emitArithmetic(as, 0x5C);
+            break;
+        case OP_MULTIPLY:
+            emitArithmetic(as, 0x59);
+            break;
+        case OP_DIVIDE:
+            emitArithmetic(as, 0x5E);
+            break;
+        case OP_NEGATE:
+            emitNegate(as);
+            break;
+        default:
+            emitComparison(as, generic);
+            break;
+    }
+    endChecked(as, ip, slowJumps, operands);
+}
+
+static bool translate(Assembler *as, Chunk *chunk) {
+    Value const *constants = chunk->constants.values;
+    EMIT(0x53,                // push rbx
+         0x41, 0x54,          // push r12
+         0x41, 0x55,          // push r13, which also keeps the stack 16-byte aligned for calls
+         0x48, 0x89, 0xFB,    // mov rbx, rdi
+         0x49, 0x89, 0xFC);   // mov r12, rdi
+
+    for (int offset = 0; offset < chunk->count;) {
+        const uint8_t *ip = chunk->code + offset;
+        uint8_t instruction = *ip;
+        offset++;
+        switch (instruction) {
+            case OP_CONSTANT:
+                emitPush(as, constants[ip[1]]);
+                offset++;
+                break;
+            case OP_NIL:
+                emitPush(as, NIL_VAL);
+                break;
+            case OP_TRUE:
+                emitPush(as, BOOL_VAL(true));
+                break;
+            case OP_FALSE:
+                emitPush(as, BOOL_VAL(false));
+                break;
+            case OP_SMALLINT:
+                emitPush(as, NUMBER_VAL((int8_t) ip[1]));
+                offset++;
+                break;
+            CASE_SHORT_CONSTANTS:
+                emitPush(as, constants[instruction - OP_CONSTANT_0]);
+                break;
+            // run() may already have quickened these; the type checks here cover both forms.
+            case OP_ADD:
+            case OP_ADD_NUM:
+                emitChecked(as, ip, OP_ADD);
+                break;
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_NEGATE:
+                emitChecked(as, ip, instruction);
+                break;
+            case OP_EQUAL:
+            case OP_EQUAL_NUM:
+                emitChecked(as, ip, OP_EQUAL);
+                break;
+            case OP_FADD:
+                emitArithmetic(as, 0x58);
+                break;
+            case OP_FSUBTRACT:
+                emitArithmetic(as, 0x5C);
+                break;
+            case OP_FMULTIPLY:
+                emitArithmetic(as, 0x59);
+                break;
+            case OP_FDIVIDE:
+                emitArithmetic(as, 0x5E);
+                break;
+            case OP_FGREATER:
+                emitComparison(as, OP_GREATER);
+                break;
+            case OP_FLESS:
+                emitComparison(as, OP_LESS);
+                break;
+            case OP_FEQUAL:
+                emitComparison(as, OP_EQUAL);
+                break;
+            case OP_FNEGATE:
+                emitNegate(as);
+                break;
+            case OP_ADD_STR:
+            case OP_CONCAT:
+            case OP_NOT:
+                emitSlowPath(as, ip);
+                break;
+            case OP_RESERVE:
+                for (int i = 0; i < ip[1]; i++) emitPush(as, NIL_VAL);
+                offset++;
+                break;
+            case OP_STORE_SLOT:
+                EMIT(0x0F, 0x10, 0x43, 0xF0,               // movups xmm0, [rbx-16]
+                     0x41, 0x0F, 0x11, 0x84, 0x24);        // movups [r12+slot], xmm0
+                emit32(as, ip[1] * sizeof(Value));
+                offset++;
+                break;
+            case OP_LOAD_SLOT:
+                EMIT(0x41, 0x0F, 0x10, 0x84, 0x24);        // movups xmm0, [r12+slot]
+                emit32(as, ip[1] * sizeof(Value));
+                EMIT(0x0F, 0x11, 0x03,                     // movups [rbx], xmm0
+                     0x48, 0x83, 0xC3, 0x10);              // add rbx, 16
+                offset++;
+                break;
+            case OP_DUP:
+                EMIT(0x0F, 0x10, 0x43, 0xF0,               // movups xmm0, [rbx-16]
+                     0x0F, 0x11, 0x03,                     // movups [rbx], xmm0
+                     0x48, 0x83, 0xC3, 0x10);              // add rbx, 16
+                break;
+            case OP_RETURN:
+                // The VM prints the result and drops the frame.
+                emitSlowPath(as, ip);
+                EMIT(0xB8);  // mov eax, INTERPRET_OK
+                emit32(as, INTERPRET_OK);
+                emitEpilogue(as);
+                break;
+            default:
+                return false;
+        }
+    }
+
+    for (int i = 0; i < as->errorCount; i++) patchJump(as, as->errorJumps[i]);
+    EMIT(0xB8);  // mov eax, INTERPRET_RUNTIME_ERROR
+    emit32(as, INTERPRET_RUNTIME_ERROR);
+    emitEpilogue(as);
+    return true;
+}
+
+bool jitCompile(Chunk *chunk) {
+    Assembler as = {NULL, 0, 0, NULL, 0, 0};
+    bool translated = translate(&as, chunk);
+    void *native = MAP_FAILED;
+    if (translated) {
+        // Written while writable, then flipped to executable: never both at once.
+        native = mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (native != MAP_FAILED) {
+            memcpy(native, as.code, as.count);
+            if (mprotect(native, as.count, PROT_READ | PROT_EXEC) != 0) {
+                munmap(native, as.count);
+                native = MAP_FAILED;
+            }
+        }
+    }
+    if (native != MAP_FAILED) {
+        chunk->native = native;
+        chunk->nativeSize = as.count;
+    }
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    FREE_ARRAY(int, as.errorJumps, as.errorCapacity);
+    return native != MAP_FAILED;
+}
+
+InterpretResult jitRun(Chunk *chunk) {
+    NativeCode code = (NativeCode) chunk->native;
+    return code(vm.stackTop);
+}
+
+void jitFree(Chunk *chunk) {
+    if (chunk->native == NULL) return;
+    munmap(chunk->native, chunk->nativeSize);
+    chunk->native = NULL;
+    chunk->nativeSize = 0;
+}
+
+#undef EMIT
+
+#else
+
+bool jitCompile(Chunk *chunk) {
+    (void) chunk;
+    return false;
+}
+
+InterpretResult jitRun(Chunk *chunk) {
+    (void) chunk;
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+void jitFree(Chunk *chunk) {
+    (void) chunk;
+}
+
+#endif
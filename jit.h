@@ -0,0 +1,29 @@
+//
+// Created by neepoo on 23-2-20.
+//
+
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// A template JIT: every instruction of a hot chunk is replaced by a fixed piece of x86-64 machine code.
+// Numbers are handled inline; strings, type errors and printing call back into the VM (runSlowPath()).
+// Where it cannot work (another CPU, tracing turned on, the CMake option off) chunks simply stay in run().
+#if defined(CLOX_JIT) && defined(__x86_64__) && defined(__unix__) && !defined(DEBUG_TRACE_EXECUTION)
+#define JIT_AVAILABLE
+#endif
+
+// How many times interpretChunk() runs a chunk in the interpreter before compiling it.
+#define JIT_THRESHOLD 8
+
+// Translates the chunk into chunk->native. Returns false, leaving the chunk untouched, if that fails.
+bool jitCompile(Chunk *chunk);
+
+// Runs chunk->native on the VM stack. The stack must already hold chunk->maxStack more values.
+InterpretResult jitRun(Chunk *chunk);
+
+void jitFree(Chunk *chunk);
+
+#endif
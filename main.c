@@ -1,12 +1,31 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "aot.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "profiler.h"
+#include "serve.h"
 #include "vm.h"
 
-static char *readFile(const char *path);
+// A source file, either mapped straight from the page cache or read into a heap buffer.
+typedef struct {
+    char *chars;
+    size_t length;
+    bool mapped;
+} SourceFile;
+
+static SourceFile loadFile(const char *path);
+
+static void unloadFile(SourceFile *file);
 
 static void repl() {
     char line[1024];
@@ -17,54 +36,375 @@ static void repl() {
             break;
         }
         interpret(line);
+        flushWriter(&vm.out);
+    }
+}
+
+// Streaming mode reads stdin in large blocks instead of one fgets() per line,
+// so a record may be arbitrarily long, and results pile up in vm.out with no prompt.
+#define STREAM_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    char *buffer;
+    size_t capacity;
+    size_t start;  // first byte of the record that has not been evaluated yet
+    size_t end;    // one past the last byte read from the stream
+} LineReader;
+
+static int evaluateRecord(const char *record, size_t length, int status) {
+    if (length == 0) return status;
+    InterpretResult result = interpretLength(record, length);
+    if (status != 0) return status;
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+// When stdin is redirected from a regular file we can map it and walk the records
+// without any read() calls at all. Records are handed to the scanner in place.
+static bool streamMapped(int *status) {
+    struct stat info;
+    if (fstat(STDIN_FILENO, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) return false;
+    size_t size = (size_t) info.st_size;
+    char *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (mapped == MAP_FAILED) return false;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    const char *current = mapped;
+    const char *end = mapped + size;
+    while (current < end) {
+        const char *newline = memchr(current, '\n', (size_t) (end - current));
+        if (newline == NULL) newline = end;
+        *status = evaluateRecord(current, (size_t) (newline - current), *status);
+        current = newline + 1;
     }
+    munmap(mapped, size);
+    return true;
+}
+
+static void streamBuffered(int *status) {
+    LineReader reader;
+    reader.capacity = STREAM_BUFFER_SIZE;
+    reader.buffer = (char *) malloc(reader.capacity);
+    reader.start = 0;
+    reader.end = 0;
+    if (reader.buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read stdin.\n");
+        exit(74);
+    }
+
+    for (;;) {
+        // Evaluate every complete record already in the buffer, in place.
+        size_t scanned = reader.start;
+        for (;;) {
+            char *newline = memchr(reader.buffer + scanned, '\n', reader.end - scanned);
+            if (newline == NULL) break;
+            size_t length = (size_t) (newline - (reader.buffer + reader.start));
+            *status = evaluateRecord(reader.buffer + reader.start, length, *status);
+            reader.start += length + 1;
+            scanned = reader.start;
+        }
+
+        // Slide the partial record to the front, and grow the buffer when a
+        // single record does not fit.
+        size_t pending = reader.end - reader.start;
+        memmove(reader.buffer, reader.buffer + reader.start, pending);
+        reader.start = 0;
+        reader.end = pending;
+        if (reader.end == reader.capacity) {
+            reader.capacity *= 2;
+            char *grown = (char *) realloc(reader.buffer, reader.capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "Not enough memory to read stdin.\n");
+                exit(74);
+            }
+            reader.buffer = grown;
+        }
+
+        ssize_t bytesRead = read(STDIN_FILENO, reader.buffer + reader.end, reader.capacity - reader.end);
+        if (bytesRead < 0) {
+            fprintf(stderr, "Could not read stdin.\n");
+            exit(74);
+        }
+        if (bytesRead == 0) break;
+        reader.end += (size_t) bytesRead;
+    }
+
+    // The last record may not end with a newline.
+    *status = evaluateRecord(reader.buffer, reader.end, *status);
+    free(reader.buffer);
+}
+
+static int streamStdin() {
+    int status = 0;
+    if (!streamMapped(&status)) streamBuffered(&status);
+    flushWriter(&vm.out);
+    return status;
 }
 
 static void runFile(const char *path) {
-    char *source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    SourceFile source = loadFile(path);
+    InterpretResult result = interpretLength(source.chars, source.length);
+    unloadFile(&source);
+    flushWriter(&vm.out);
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
-static char *readFile(const char *path) {
+// Fallback for anything that cannot be mapped, such as a pipe passed as /dev/stdin.
+static SourceFile readFile(FILE *file, const char *path) {
+    SourceFile source;
+    size_t capacity = 1 << 16;
+    source.chars = (char *) malloc(capacity);
+    source.length = 0;
+    source.mapped = false;
+    for (;;) {
+        if (source.chars == NULL) {
+            fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+            exit(74);
+        }
+        source.length += fread(source.chars + source.length, sizeof(char), capacity - source.length, file);
+        if (source.length < capacity) break;
+        capacity *= 2;
+        source.chars = (char *) realloc(source.chars, capacity);
+    }
+    if (ferror(file)) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    return source;
+}
+
+// The scanner takes an explicit length, so a regular file can be mapped read-only and compiled
+// where it sits: no copy, no terminator and no second buffer the size of the file.
+static SourceFile loadFile(const char *path) {
     FILE *file = fopen(path, "rb");
     if (file == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
-    // 惯用方法获取文件的大小
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    // back to begin
-    rewind(file);
-    char *buffer = (char *) malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
-    }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+    SourceFile source;
+    struct stat info;
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode)) {
+        source.length = (size_t) info.st_size;
+        source.mapped = true;
+        if (source.length == 0) {
+            // mmap() refuses empty mappings.
+            source.chars = NULL;
+            fclose(file);
+            return source;
+        }
+        void *mapped = mmap(NULL, source.length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, source.length, MADV_SEQUENTIAL);
+            source.chars = (char *) mapped;
+            fclose(file);
+            return source;
+        }
     }
-    buffer[bytesRead] = '\0';
+    source = readFile(file, path);
     fclose(file);
-    // 调用法需要free掉buffer
-    // TEST GIT COMMIT SIG
-    return buffer;
+    return source;
+}
+
+static void unloadFile(SourceFile *file) {
+    if (!file->mapped) {
+        free(file->chars);
+    } else if (file->chars != NULL) {
+        munmap(file->chars, file->length);
+    }
+}
+
+// --schedule: every line of stdin becomes a task, and they all take turns of quantum instructions. Each
+// result is written as it finishes, after the number of its line among the non-empty ones.
+static int scheduleStdin(int quantum) {
+    SourceFile source = loadFile("/dev/stdin");
+    Scheduler scheduler;
+    initScheduler(&scheduler, quantum);
+    int status = 0;
+    const char *end = source.chars + source.length;
+    for (const char *start = source.chars; start < end;) {
+        const char *newline = memchr(start, '\n', (size_t) (end - start));
+        const char *lineEnd = newline != NULL ? newline : end;
+        if (lineEnd > start && spawnTask(&scheduler, start, (size_t) (lineEnd - start)) == NULL) status = 65;
+        start = lineEnd + 1;
+    }
+
+    Task *finished;
+    char number[16];
+    while (runSlice(&scheduler, &finished)) {
+        if (finished == NULL) continue;
+        if (finished->result == INTERPRET_RUNTIME_ERROR && status == 0) status = 70;
+        if (finished->out.count > 0) {
+            writeChars(&vm.out, number, snprintf(number, sizeof(number), "%d\t", finished->id));
+            writeChars(&vm.out, finished->out.chars, finished->out.count);
+        }
+        freeTask(finished);
+    }
+    freeScheduler(&scheduler);
+    unloadFile(&source);
+    flushWriter(&vm.out);
+    return status;
+}
+
+// --emit-c: compiles the file and writes it out as C instead of running it.
+static void emitCFile(const char *path) {
+    SourceFile source = loadFile(path);
+    Chunk chunk;
+    initChunk(&chunk);
+    bool compiled = compile(source.chars, source.length, &chunk);
+    unloadFile(&source);
+    if (!compiled) exit(65);
+    if (!emitC(&chunk, stdout)) {
+        fprintf(stderr, "--emit-c can only translate stack code.\n");
+        exit(65);
+    }
+    freeChunk(&chunk);
+}
+
+// --save-image: compiles every line of the file and saves the chunks, with the interned strings, as an image.
+static void saveImageFile(const char *imagePath, const char *path) {
+    SourceFile source = loadFile(path);
+    int count = 0;
+    int capacity = 0;
+    Chunk *chunks = NULL;
+    const char **sources = NULL;
+    size_t *lengths = NULL;
+    const char *end = source.chars + source.length;
+    for (const char *start = source.chars; start < end;) {
+        const char *newline = memchr(start, '\n', (size_t) (end - start));
+        const char *lineEnd = newline != NULL ? newline : end;
+        if (lineEnd > start) {
+            if (count == capacity) {
+                capacity = capacity < 8 ? 8 : capacity * 2;
+                chunks = (Chunk *) realloc(chunks, sizeof(Chunk) * capacity);
+                sources = (const char **) realloc(sources, sizeof(const char *) * capacity);
+                lengths = (size_t *) realloc(lengths, sizeof(size_t) * capacity);
+                if (chunks == NULL || sources == NULL || lengths == NULL) exit(74);
+            }
+            initChunk(&chunks[count]);
+            if (!compile(start, (size_t) (lineEnd - start), &chunks[count])) exit(65);
+            sources[count] = start;
+            lengths[count] = (size_t) (lineEnd - start);
+            count++;
+        }
+        start = lineEnd + 1;
+    }
+
+    bool saved = saveImage(imagePath, chunks, sources, lengths, count);
+    for (int i = 0; i < count; i++) freeChunk(&chunks[i]);
+    free(chunks);
+    free(sources);
+    free(lengths);
+    unloadFile(&source);
+    if (!saved) exit(74);
+}
+
+static void runNativeFile(const char *path) {
+    InterpretResult result = runNative(path);
+    flushWriter(&vm.out);
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+// Like reportMemory(); stopSampling() does nothing once it has run.
+static void reportSamples() {
+    stopSampling(stderr);
+}
+
+static bool memoryReport = false;
+
+// Runs before freeVM() on the way out of main(), or from atexit() when an error exits early.
+static void reportMemory() {
+    if (!memoryReport) return;
+    memoryReport = false;
+    printMemoryStats(stderr);
 }
 
 int main(int argc, const char *argv[]) {
     initVM();
+    int status = 0;
+    // Options that change how everything in this run is compiled or evaluated come first.
+    // --registers: compile to the register instruction set. --arena: evaluate in arena mode.
+    // --image <file>: start from a heap image written by --save-image.
+    // --mem-stats: report heap use on stderr at exit (needs a CLOX_MEM_STATS build).
+    // --sample <file>: profile with a sampling timer; collapsed stacks go to the file, the rest to stderr.
+    // --cache <chunks>: keep that many compiled chunks for sources that come again.
+    // --heap-limit <bytes>: fail an evaluation with a runtime error once scripts hold that much memory.
+    // --max-depth <n>: how deeply an expression's operators and parentheses may nest.
+    while (argc > 1) {
+        int used = 1;
+        if (strcmp(argv[1], "--registers") == 0) {
+            setBackend(BACKEND_REGISTER);
+        } else if (strcmp(argv[1], "--arena") == 0) {
+            setArenaMode(true);
+        } else if (strcmp(argv[1], "--image") == 0 && argc > 2) {
+            if (!loadImage(&vm.image, argv[2])) exit(74);
+            used = 2;
+        } else if (strcmp(argv[1], "--heap-limit") == 0 && argc > 2) {
+            char *end;
+            unsigned long long bytes = strtoull(argv[2], &end, 10);
+            if (*argv[2] == '\0' || *end != '\0') {
+                fprintf(stderr, "--heap-limit expects a number of bytes, not \"%s\".\n", argv[2]);
+                exit(64);
+            }
+            setHeapLimit((size_t) bytes);
+            used = 2;
+        } else if (strcmp(argv[1], "--max-depth") == 0 && argc > 2) {
+            char *end;
+            long depth = strtol(argv[2], &end, 10);
+            if (*argv[2] == '\0' || *end != '\0' || depth <= 0 || depth > INT_MAX) {
+                fprintf(stderr, "--max-depth expects a positive number, not \"%s\".\n", argv[2]);
+                exit(64);
+            }
+            setMaxExpressionDepth((int) depth);
+            used = 2;
+        } else if (strcmp(argv[1], "--sample") == 0 && argc > 2) {
+            if (!startSampling(argv[2])) exit(74);
+            atexit(reportSamples);
+            used = 2;
+        } else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+            char *end;
+            long chunks = strtol(argv[2], &end, 10);
+            if (*argv[2] == '\0' || *end != '\0' || chunks < 0 || chunks > INT_MAX) {
+                fprintf(stderr, "--cache expects a number of chunks, not \"%s\".\n", argv[2]);
+                exit(64);
+            }
+            setChunkCacheCapacity((int) chunks);
+            used = 2;
+        } else if (strcmp(argv[1], "--mem-stats") == 0) {
+            memoryReport = true;
+            atexit(reportMemory);
+        } else {
+            break;
+        }
+        argv += used;
+        argc -= used;
+    }
     if (argc == 1) {
         repl();
+    } else if (argc == 2 && strcmp(argv[1], "--stream") == 0) {
+        status = streamStdin();
     } else if (argc == 2) {
         runFile(argv[1]);
+    } else if (argc == 3 && strcmp(argv[1], "--schedule") == 0 && atoi(argv[2]) > 0) {
+        status = scheduleStdin(atoi(argv[2]));
+    } else if (argc == 3 && strcmp(argv[1], "--serve") == 0) {
+        status = serve(argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "--emit-c") == 0) {
+        emitCFile(argv[2]);
+    } else if (argc == 3 && strcmp(argv[1], "--native") == 0) {
+        runNativeFile(argv[2]);
+    } else if (argc == 4 && strcmp(argv[1], "--save-image") == 0) {
+        saveImageFile(argv[2], argv[3]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--registers] [--arena] [--image file] [--mem-stats] [--heap-limit bytes]\n"
+                        "            [--max-depth n] [--cache chunks] [--sample file]\n"
+                        "            [--stream | --schedule quantum | --serve socket | path | --emit-c path |\n"
+                        "             --native library | --save-image file path]\n");
     }
+    reportSamples();
+    reportMemory();
     freeVM();
-    return 0;
+    return status;
 }
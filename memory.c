@@ -14,6 +14,29 @@
 //Non‑zero	Smaller than oldSize	Shrink existing allocation.
 //Non‑zero	Larger than oldSize	    Grow existing allocation.
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+    // During an arena evaluation new memory, and memory that already came from the arena, is bump
+    // allocated. Anything older is still on the heap and is handled there.
+    if (vm.inArena && (pointer == NULL || arenaOwns(&vm.arena, pointer))) {
+        vm.arena.blockLimit = heapHeadroom();
+        void *result = arenaReallocate(&vm.arena, pointer, oldSize, newSize);
+        if (result == NULL && newSize > 0) outOfMemory();
+        return result;
+    }
+    if (newSize > oldSize && newSize - oldSize > heapHeadroom()) outOfMemory();
+    void *result = NULL;
+    if (newSize == 0) {
+        free(pointer);
+    } else {
+        result = realloc(pointer, newSize);
+        if (result == NULL) outOfMemory();
+    }
+    vm.bytesAllocated += newSize;
+    vm.bytesAllocated -= oldSize;
+    return result;
+}
+
+void *reallocateHeap(void *pointer, size_t oldSize, size_t newSize) {
+    (void) oldSize;
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -23,22 +46,120 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+// Frees what an object owns; the object itself goes with its page.
 static void freeObject(Obj *object) {
+#ifdef CLOX_MEM_STATS
+    recordObject(object->type, -1);
+#endif
     switch (object->type) {
         case OBJ_STRING: {
             ObjString const *string = (ObjString *) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            FREE_ARRAY_AS(MEM_STRING_CHARS, char, string->chars, string->length + 1);
             break;
         }
     }
 }
 
 void freeObjects() {
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        Obj *next = object->next;
-        freeObject(object);
-        object = next;
+    walkHeap(&vm.heap, freeObject);
+    freeHeap(&vm.heap);
+};
+
+static const char *const kindNames[MEM_KIND_COUNT] = {
+        [MEM_OTHER] = "other",
+        [MEM_OBJECT] = "objects",
+        [MEM_CHUNK_CODE] = "chunk code",
+        [MEM_CHUNK_LINES] = "chunk lines",
+        [MEM_CONSTANTS] = "constants",
+        [MEM_TABLE_ENTRIES] = "table entries",
+        [MEM_STRING_CHARS] = "string chars",
+        [MEM_STACK] = "stack",
+        [MEM_NURSERY] = "nursery",
+};
+
+static const char *const objectNames[OBJ_TYPE_COUNT] = {
+        [OBJ_STRING] = "string",
+};
+
+#ifdef CLOX_MEM_STATS
+
+static MemoryStats stats;
+
+static void count(MemoryCounters *counters, size_t oldSize, size_t newSize) {
+    if (oldSize == 0 && newSize > 0) counters->allocations++;
+    if (oldSize > 0 && newSize > oldSize) counters->growths++;
+    if (oldSize > 0 && newSize == 0) counters->frees++;
+    counters->liveBytes += newSize;
+    counters->liveBytes -= oldSize;
+    if (counters->liveBytes > counters->peakBytes) counters->peakBytes = counters->liveBytes;
+}
+
+void recordAllocation(MemoryKind kind, size_t oldSize, size_t newSize) {
+    count(&stats.total, oldSize, newSize);
+    count(&stats.kinds[kind], oldSize, newSize);
+}
+
+// Arena memory is released all at once and never freed piece by piece, so it is left out of the
+// counters (which would otherwise only ever grow) and reported as the size of the arena instead.
+void *reallocateAs(MemoryKind kind, void *pointer, size_t oldSize, size_t newSize) {
+    if (!vm.inArena || (pointer != NULL && !arenaOwns(&vm.arena, pointer))) {
+        recordAllocation(kind, oldSize, newSize);
+    }
+    return reallocate(pointer, oldSize, newSize);
+}
+
+void recordObject(ObjType type, int change) {
+    if (vm.inArena) return;
+    stats.liveObjects[type] += change;
+    if (change > 0) stats.allocatedObjects[type] += change;
+}
+
+bool getMemoryStats(MemoryStats *result) {
+    *result = stats;
+    return true;
+}
+
+#else
+
+bool getMemoryStats(MemoryStats *result) {
+    (void) result;
+    return false;
+}
+
+#endif
+
+static void printCounters(FILE *file, const char *name, const MemoryCounters *counters) {
+    fprintf(file, "  %-14s %12zu %12zu %10zu %10zu %10zu\n", name, counters->liveBytes, counters->peakBytes,
+            counters->allocations, counters->growths, counters->frees);
+}
+
+static void printHeapStats(FILE *file) {
+    MemoryStats current;
+    if (!getMemoryStats(&current)) {
+        fprintf(file, "  clox was built without CLOX_MEM_STATS; there are no heap statistics.\n");
+        return;
+    }
+    fprintf(file, "  %-14s %12s %12s %10s %10s %10s\n", "kind", "live bytes", "peak bytes", "allocs", "grows",
+            "frees");
+    for (int i = 0; i < MEM_KIND_COUNT; i++) printCounters(file, kindNames[i], &current.kinds[i]);
+    printCounters(file, "total", &current.total);
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(file, "  %s objects: %zu live, %zu allocated\n", objectNames[i], current.liveObjects[i],
+                current.allocatedObjects[i]);
     }
-};
\ No newline at end of file
+}
+
+void printMemoryStats(FILE *file) {
+    fprintf(file, "== memory ==\n");
+    printHeapStats(file);
+    fprintf(file, "  object heap: %zu objects in %zu pages, %zu bytes\n", vm.heap.objectCount, vm.heap.pageCount,
+            vm.heap.pageBytes);
+    fprintf(file, "  nursery: %zu strings made, %zu promoted to the heap\n", vm.nursery.strings,
+            vm.nursery.promoted);
+    fprintf(file, "  arena: %zu bytes in blocks\n", vm.arena.blockBytes);
+    fprintf(file, "  image: %zu bytes mapped\n", vm.image.size);
+    if (vm.cache.capacity > 0) {
+        fprintf(file, "  chunk cache: %d of %d chunks, %zu hits, %zu misses, %zu evictions\n", vm.cache.count,
+                vm.cache.capacity, vm.cache.hits, vm.cache.misses, vm.cache.evictions);
+    }
+}
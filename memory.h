@@ -5,23 +5,99 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+// What an allocation is for, so the heap profiler (CLOX_MEM_STATS) can say where the bytes go.
+typedef enum {
+    MEM_OTHER,  // compiler working memory, output buffers and the like
+    MEM_OBJECT,
+    MEM_CHUNK_CODE,
+    MEM_CHUNK_LINES,
+    MEM_CONSTANTS,
+    MEM_TABLE_ENTRIES,
+    MEM_STRING_CHARS,
+    MEM_STACK,
+    MEM_NURSERY,
+    MEM_KIND_COUNT,
+} MemoryKind;
+
+// Without CLOX_MEM_STATS the kind is dropped here and nothing is counted.
+#ifdef CLOX_MEM_STATS
+#define REALLOCATE(kind, pointer, oldSize, newSize) reallocateAs(kind, pointer, oldSize, newSize)
+#define REALLOCATE_HEAP(kind, pointer, oldSize, newSize) \
+    (recordAllocation(kind, oldSize, newSize), reallocateHeap(pointer, oldSize, newSize))
+#else
+#define REALLOCATE(kind, pointer, oldSize, newSize) reallocate(pointer, oldSize, newSize)
+#define REALLOCATE_HEAP(kind, pointer, oldSize, newSize) reallocateHeap(pointer, oldSize, newSize)
+#endif
+
+#define ALLOCATE_AS(kind, type, count) \
+    (type*)REALLOCATE(kind, NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(type, count) ALLOCATE_AS(MEM_OTHER, type, count)
+#define FREE(type, pointer) REALLOCATE(MEM_OTHER, pointer, sizeof(type), 0)
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type *)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+#define GROW_ARRAY_AS(kind, type, pointer, oldCount, newCount) \
+    (type *)REALLOCATE(kind, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+#define GROW_ARRAY(type, pointer, oldCount, newCount) GROW_ARRAY_AS(MEM_OTHER, type, pointer, oldCount, newCount)
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY_AS(kind, type, pointer, oldCount) \
+    REALLOCATE(kind, pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(type, pointer, oldCount) FREE_ARRAY_AS(MEM_OTHER, type, pointer, oldCount)
 
+// Memory the VM keeps across evaluations (its stack, its output buffer) must never come from the
+// evaluation arena, so it is grown with these instead.
+#define ALLOCATE_HEAP(type, count) \
+    (type*)REALLOCATE_HEAP(MEM_OTHER, NULL, 0, sizeof(type) * (count))
+#define GROW_HEAP_ARRAY_AS(kind, type, pointer, oldCount, newCount) \
+    (type *)REALLOCATE_HEAP(kind, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+#define GROW_HEAP_ARRAY(type, pointer, oldCount, newCount) \
+    GROW_HEAP_ARRAY_AS(MEM_OTHER, type, pointer, oldCount, newCount)
+#define FREE_HEAP_ARRAY_AS(kind, type, pointer, oldCount) \
+    REALLOCATE_HEAP(kind, pointer, sizeof(type) * (oldCount), 0)
+#define FREE_HEAP_ARRAY(type, pointer, oldCount) FREE_HEAP_ARRAY_AS(MEM_OTHER, type, pointer, oldCount)
+
+// Counts against the heap limit (setHeapLimit()). While the interpreter is running, asking for more
+// than is left raises a runtime error instead of returning.
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+// Outside the heap limit and the arena, for memory the VM keeps for itself.
+void *reallocateHeap(void *pointer, size_t oldSize, size_t newSize);
+
+typedef struct {
+    size_t liveBytes;
+    size_t peakBytes;
+    size_t allocations;  // blocks allocated from nothing
+    size_t growths;  // blocks reallocated to a bigger size, mostly GROW_ARRAY
+    size_t frees;
+} MemoryCounters;
+
+// Heap memory only: the arena and a mapped image are reported by their size, not per allocation.
+typedef struct {
+    MemoryCounters total;
+    MemoryCounters kinds[MEM_KIND_COUNT];
+    size_t liveObjects[OBJ_TYPE_COUNT];
+    size_t allocatedObjects[OBJ_TYPE_COUNT];
+} MemoryStats;
+
+#ifdef CLOX_MEM_STATS
+void *reallocateAs(MemoryKind kind, void *pointer, size_t oldSize, size_t newSize);
+
+void recordAllocation(MemoryKind kind, size_t oldSize, size_t newSize);
+
+void recordObject(ObjType type, int change);
+#endif
+
+// Fills in stats and returns true, or returns false if clox was built without CLOX_MEM_STATS.
+bool getMemoryStats(MemoryStats *stats);
+
+// The --mem-stats report.
+void printMemoryStats(FILE *file);
+
 void freeObjects();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,373 @@
+//
+// Created by neepoo on 23-2-2.
+//
+// Number formatting uses Grisu2 (Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers"). It works entirely with 64-bit integers, never touches the locale, and always produces
+// digits that round-trip; in the rare cases where it is not the very shortest it is at most one digit longer.
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "number.h"
+
+// A "do-it-yourself floating point": a 64-bit significand and a binary exponent, value = f * 2^e.
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DOUBLE_SIGNIFICAND_SIZE 52
+#define DOUBLE_EXPONENT_BIAS (0x3FF + DOUBLE_SIGNIFICAND_SIZE)
+#define DOUBLE_HIDDEN_BIT ((uint64_t) 1 << DOUBLE_SIGNIFICAND_SIZE)
+#define DOUBLE_SIGNIFICAND_MASK (DOUBLE_HIDDEN_BIT - 1)
+#define DOUBLE_EXPONENT_MASK ((uint64_t) 0x7FF << DOUBLE_SIGNIFICAND_SIZE)
+
+// Normalized powers of ten 10^k for k = -348, -340, ..., 340, rounded to 64 bits.
+// Stepping by 8 keeps the table small while still landing the product in the range DigitGen needs.
+static const struct {
+    uint64_t f;
+    int16_t e;
+} cachedPowers[] = {
+        {0xfa8fd5a0081c0288ull, -1220},  // 1e-348
+        {0xbaaee17fa23ebf76ull, -1193},  // 1e-340
+        {0x8b16fb203055ac76ull, -1166},  // 1e-332
+        {0xcf42894a5dce35eaull, -1140},  // 1e-324
+        {0x9a6bb0aa55653b2dull, -1113},  // 1e-316
+        {0xe61acf033d1a45dfull, -1087},  // 1e-308
+        {0xab70fe17c79ac6caull, -1060},  // 1e-300
+        {0xff77b1fcbebcdc4full, -1034},  // 1e-292
+        {0xbe5691ef416bd60cull, -1007},  // 1e-284
+        {0x8dd01fad907ffc3cull, -980},  // 1e-276
+        {0xd3515c2831559a83ull, -954},  // 1e-268
+        {0x9d71ac8fada6c9b5ull, -927},  // 1e-260
+        {0xea9c227723ee8bcbull, -901},  // 1e-252
+        {0xaecc49914078536dull, -874},  // 1e-244
+        {0x823c12795db6ce57ull, -847},  // 1e-236
+        {0xc21094364dfb5637ull, -821},  // 1e-228
+        {0x9096ea6f3848984full, -794},  // 1e-220
+        {0xd77485cb25823ac7ull, -768},  // 1e-212
+        {0xa086cfcd97bf97f4ull, -741},  // 1e-204
+        {0xef340a98172aace5ull, -715},  // 1e-196
+        {0xb23867fb2a35b28eull, -688},  // 1e-188
+        {0x84c8d4dfd2c63f3bull, -661},  // 1e-180
+        {0xc5dd44271ad3cdbaull, -635},  // 1e-172
+        {0x936b9fcebb25c996ull, -608},  // 1e-164
+        {0xdbac6c247d62a584ull, -582},  // 1e-156
+        {0xa3ab66580d5fdaf6ull, -555},  // 1e-148
+        {0xf3e2f893dec3f126ull, -529},  // 1e-140
+        {0xb5b5ada8aaff80b8ull, -502},  // 1e-132
+        {0x87625f056c7c4a8bull, -475},  // 1e-124
+        {0xc9bcff6034c13053ull, -449},  // 1e-116
+        {0x964e858c91ba2655ull, -422},  // 1e-108
+        {0xdff9772470297ebdull, -396},  // 1e-100
+        {0xa6dfbd9fb8e5b88full, -369},  // 1e-92
+        {0xf8a95fcf88747d94ull, -343},  // 1e-84
+        {0xb94470938fa89bcfull, -316},  // 1e-76
+        {0x8a08f0f8bf0f156bull, -289},  // 1e-68
+        {0xcdb02555653131b6ull, -263},  // 1e-60
+        {0x993fe2c6d07b7facull, -236},  // 1e-52
+        {0xe45c10c42a2b3b06ull, -210},  // 1e-44
+        {0xaa242499697392d3ull, -183},  // 1e-36
+        {0xfd87b5f28300ca0eull, -157},  // 1e-28
+        {0xbce5086492111aebull, -130},  // 1e-20
+        {0x8cbccc096f5088ccull, -103},  // 1e-12
+        {0xd1b71758e219652cull, -77},  // 1e-4
+        {0x9c40000000000000ull, -50},  // 1e4
+        {0xe8d4a51000000000ull, -24},  // 1e12
+        {0xad78ebc5ac620000ull, 3},  // 1e20
+        {0x813f3978f8940984ull, 30},  // 1e28
+        {0xc097ce7bc90715b3ull, 56},  // 1e36
+        {0x8f7e32ce7bea5c70ull, 83},  // 1e44
+        {0xd5d238a4abe98068ull, 109},  // 1e52
+        {0x9f4f2726179a2245ull, 136},  // 1e60
+        {0xed63a231d4c4fb27ull, 162},  // 1e68
+        {0xb0de65388cc8ada8ull, 189},  // 1e76
+        {0x83c7088e1aab65dbull, 216},  // 1e84
+        {0xc45d1df942711d9aull, 242},  // 1e92
+        {0x924d692ca61be758ull, 269},  // 1e100
+        {0xda01ee641a708deaull, 295},  // 1e108
+        {0xa26da3999aef774aull, 322},  // 1e116
+        {0xf209787bb47d6b85ull, 348},  // 1e124
+        {0xb454e4a179dd1877ull, 375},  // 1e132
+        {0x865b86925b9bc5c2ull, 402},  // 1e140
+        {0xc83553c5c8965d3dull, 428},  // 1e148
+        {0x952ab45cfa97a0b3ull, 455},  // 1e156
+        {0xde469fbd99a05fe3ull, 481},  // 1e164
+        {0xa59bc234db398c25ull, 508},  // 1e172
+        {0xf6c69a72a3989f5cull, 534},  // 1e180
+        {0xb7dcbf5354e9beceull, 561},  // 1e188
+        {0x88fcf317f22241e2ull, 588},  // 1e196
+        {0xcc20ce9bd35c78a5ull, 614},  // 1e204
+        {0x98165af37b2153dfull, 641},  // 1e212
+        {0xe2a0b5dc971f303aull, 667},  // 1e220
+        {0xa8d9d1535ce3b396ull, 694},  // 1e228
+        {0xfb9b7cd9a4a7443cull, 720},  // 1e236
+        {0xbb764c4ca7a44410ull, 747},  // 1e244
+        {0x8bab8eefb6409c1aull, 774},  // 1e252
+        {0xd01fef10a657842cull, 800},  // 1e260
+        {0x9b10a4e5e9913129ull, 827},  // 1e268
+        {0xe7109bfba19c0c9dull, 853},  // 1e276
+        {0xac2820d9623bf429ull, 880},  // 1e284
+        {0x80444b5e7aa7cf85ull, 907},  // 1e292
+        {0xbf21e44003acdd2dull, 933},  // 1e300
+        {0x8e679c2f5e44ff8full, 960},  // 1e308
+        {0xd433179d9c8cb841ull, 986},  // 1e316
+        {0x9e19db92b4e31ba9ull, 1013},  // 1e324
+        {0xeb96bf6ebadf77d9ull, 1039},  // 1e332
+        {0xaf87023b9bf0ee6bull, 1066},  // 1e340
+};
+
+static const uint64_t powersOfTen[] = {
+        1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+        1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+        100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+        1000000000000000000ull, 10000000000000000000ull,
+};
+
+static uint64_t doubleBits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static DiyFp makeDiyFp(uint64_t f, int e) {
+    DiyFp fp;
+    fp.f = f;
+    fp.e = e;
+    return fp;
+}
+
+static DiyFp diyFpFromDouble(double value) {
+    uint64_t bits = doubleBits(value);
+    int biased = (int) ((bits & DOUBLE_EXPONENT_MASK) >> DOUBLE_SIGNIFICAND_SIZE);
+    uint64_t significand = bits & DOUBLE_SIGNIFICAND_MASK;
+    // Subnormals have no hidden bit and a fixed exponent.
+    if (biased == 0) return makeDiyFp(significand, 1 - DOUBLE_EXPONENT_BIAS);
+    return makeDiyFp(significand + DOUBLE_HIDDEN_BIT, biased - DOUBLE_EXPONENT_BIAS);
+}
+
+// The upper 64 bits of the 128-bit product, rounded.
+static DiyFp multiply(DiyFp x, DiyFp y) {
+    const uint64_t mask32 = 0xFFFFFFFFu;
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & mask32;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & mask32;
+    uint64_t ac = a * c;
+    uint64_t bc = b * c;
+    uint64_t ad = a * d;
+    uint64_t bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & mask32) + (bc & mask32);
+    tmp += 1u << 31;
+    return makeDiyFp(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+static DiyFp normalize(DiyFp fp) {
+    while (!(fp.f & ((uint64_t) 1 << 63))) {
+        fp.f <<= 1;
+        fp.e--;
+    }
+    return fp;
+}
+
+// Computes the two neighbours halfway to the adjacent doubles. Any decimal strictly between them
+// reads back as value.
+static void normalizedBoundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+    DiyFp upper = makeDiyFp((v.f << 1) + 1, v.e - 1);
+    while (!(upper.f & (DOUBLE_HIDDEN_BIT << 1))) {
+        upper.f <<= 1;
+        upper.e--;
+    }
+    upper.f <<= 64 - DOUBLE_SIGNIFICAND_SIZE - 2;
+    upper.e -= 64 - DOUBLE_SIGNIFICAND_SIZE - 2;
+
+    // At a power of two the gap to the next smaller double is half as wide.
+    DiyFp lower = v.f == DOUBLE_HIDDEN_BIT ? makeDiyFp((v.f << 2) - 1, v.e - 2)
+                                           : makeDiyFp((v.f << 1) - 1, v.e - 1);
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+
+    *minus = lower;
+    *plus = upper;
+}
+
+// Picks a cached 10^-k that scales a number with binary exponent e into [2^-60, 2^-32] territory.
+static DiyFp cachedPower(int e, int *k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;  // log10(2)
+    int ik = (int) dk;
+    if (dk - ik > 0.0) ik++;
+    int index = (ik >> 3) + 1;
+    *k = -(-348 + index * 8);
+    return makeDiyFp(cachedPowers[index].f, cachedPowers[index].e);
+}
+
+static int countDigits(uint32_t n) {
+    int digits = 1;
+    while (n >= 10) {
+        n /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+// Nudges the last digit down while that moves the result closer to the exact value and stays inside
+// the rounding interval.
+static void roundWeed(char *buffer, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t distance) {
+    while (rest < distance && delta - rest >= tenKappa &&
+           (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance)) {
+        buffer[length - 1]--;
+        rest += tenKappa;
+    }
+}
+
+static int generateDigits(DiyFp w, DiyFp upper, uint64_t delta, char *buffer, int *k) {
+    DiyFp one = makeDiyFp((uint64_t) 1 << -upper.e, upper.e);
+    uint64_t distance = upper.f - w.f;
+    uint32_t integral = (uint32_t) (upper.f >> -one.e);
+    uint64_t fractional = upper.f & (one.f - 1);
+    int kappa = countDigits(integral);
+    int length = 0;
+
+    while (kappa > 0) {
+        uint32_t divisor = (uint32_t) powersOfTen[kappa - 1];
+        uint32_t digit = integral / divisor;
+        integral %= divisor;
+        if (digit != 0 || length != 0) buffer[length++] = (char) ('0' + digit);
+        kappa--;
+        uint64_t rest = ((uint64_t) integral << -one.e) + fractional;
+        if (rest <= delta) {
+            *k += kappa;
+            roundWeed(buffer, length, delta, rest, powersOfTen[kappa] << -one.e, distance);
+            return length;
+        }
+    }
+
+    for (;;) {
+        fractional *= 10;
+        delta *= 10;
+        char digit = (char) (fractional >> -one.e);
+        if (digit != 0 || length != 0) buffer[length++] = (char) ('0' + digit);
+        fractional &= one.f - 1;
+        kappa--;
+        if (fractional < delta) {
+            *k += kappa;
+            int index = -kappa;
+            roundWeed(buffer, length, delta, fractional, one.f, index < 20 ? distance * powersOfTen[index] : 0);
+            return length;
+        }
+    }
+}
+
+// Produces the digits of a positive finite value; value == digits * 10^k.
+static int grisu2(double value, char *buffer, int *k) {
+    DiyFp v = diyFpFromDouble(value);
+    DiyFp minus, plus;
+    normalizedBoundaries(v, &minus, &plus);
+
+    DiyFp power = cachedPower(plus.e, k);
+    DiyFp w = multiply(normalize(v), power);
+    DiyFp upper = multiply(plus, power);
+    DiyFp lower = multiply(minus, power);
+    // Shrink the interval by one unit on each side to absorb the error of the cached power.
+    lower.f++;
+    upper.f--;
+    return generateDigits(w, upper, upper.f - lower.f, buffer, k);
+}
+
+static int writeExponent(int exponent, char *buffer) {
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0) exponent = -exponent;
+    if (exponent >= 100) buffer[length++] = (char) ('0' + exponent / 100);
+    if (exponent >= 10) buffer[length++] = (char) ('0' + exponent / 10 % 10);
+    buffer[length++] = (char) ('0' + exponent % 10);
+    return length;
+}
+
+// Lays the digits out the way JavaScript's Number.prototype.toString() does: plain notation for
+// 1e-7 < |value| < 1e21 and exponent notation outside that range.
+static int prettify(char *buffer, int length, int k) {
+    int point = length + k;  // value == 0.digits * 10^point
+
+    if (length <= point && point <= 21) {
+        // 1234e7 -> 12340000000
+        memset(buffer + length, '0', (size_t) k);
+        return point;
+    }
+    if (0 < point && point <= 21) {
+        // 1234e-2 -> 12.34
+        memmove(buffer + point + 1, buffer + point, (size_t) (length - point));
+        buffer[point] = '.';
+        return length + 1;
+    }
+    if (-6 < point && point <= 0) {
+        // 1234e-6 -> 0.001234
+        int offset = 2 - point;
+        memmove(buffer + offset, buffer, (size_t) length);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        memset(buffer + 2, '0', (size_t) -point);
+        return length + offset;
+    }
+    if (length == 1) {
+        // 1e30
+        return 1 + writeExponent(point - 1, buffer + 1);
+    }
+    // 1234e30 -> 1.234e+33
+    memmove(buffer + 2, buffer + 1, (size_t) (length - 1));
+    buffer[1] = '.';
+    return length + 1 + writeExponent(point - 1, buffer + length + 1);
+}
+
+int formatNumber(double value, char *buffer) {
+    uint64_t bits = doubleBits(value);
+    int length = 0;
+    if (bits >> 63) buffer[length++] = '-';
+
+    if ((bits & DOUBLE_EXPONENT_MASK) == DOUBLE_EXPONENT_MASK) {
+        // Spelled the same way printf("%g") did, sign included: 0/0 is a negative NaN on x86.
+        memcpy(buffer + length, bits & DOUBLE_SIGNIFICAND_MASK ? "nan" : "inf", 3);
+        return length + 3;
+    }
+    if ((bits & ~((uint64_t) 1 << 63)) == 0) {
+        buffer[length++] = '0';
+        return length;
+    }
+
+    int k;
+    int digits = grisu2(value < 0 ? -value : value, buffer + length, &k);
+    return length + prettify(buffer + length, digits, k);
+}
+
+// Every integer up to 2^53 and every power of ten up to 10^22 is exact in a double, so one correctly
+// rounded multiply or divide gives the correctly rounded result (Clinger's fast path).
+#define MAX_EXACT_SIGNIFICAND ((uint64_t) 1 << 53)
+#define MAX_EXACT_POWER 22
+
+static const double exactPowersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// The lexeme is not '\0' terminated (the scanner may be pointing into the middle of the source),
+// so strtod() gets its own copy. A long one is copied to the heap, which exits if it has no room.
+static double slowDecimalToDouble(const char *lexeme, int length) {
+    char local[64];
+    char *copy = length < (int) sizeof(local) ? local : ALLOCATE_HEAP(char, length + 1);
+    memcpy(copy, lexeme, (size_t) length);
+    copy[length] = '\0';
+    double value = strtod(copy, NULL);
+    if (copy != local) FREE_HEAP_ARRAY(char, copy, length + 1);
+    return value;
+}
+
+double decimalToDouble(uint64_t significand, int exponent, bool truncated, const char *lexeme, int length) {
+    if (!truncated && significand <= MAX_EXACT_SIGNIFICAND &&
+        -MAX_EXACT_POWER <= exponent && exponent <= MAX_EXACT_POWER) {
+        double value = (double) significand;
+        if (exponent < 0) return value / exactPowersOfTen[-exponent];
+        return value * exactPowersOfTen[exponent];
+    }
+    return slowDecimalToDouble(lexeme, length);
+}
@@ -0,0 +1,22 @@
+//
+// Created by neepoo on 23-2-2.
+//
+
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// Large enough for the longest number formatNumber() can produce, e.g. "-1.2345678901234567e-308".
+#define NUMBER_BUFFER_SIZE 32
+
+// Writes the shortest decimal form of value that reads back as exactly the same double.
+// Returns the number of characters written; the buffer is not '\0' terminated.
+int formatNumber(double value, char *buffer);
+
+// Converts significand * 10^exponent, as accumulated by the scanner, to the nearest double.
+// The lexeme is only re-read when the fast path cannot give an exact answer, e.g. when the scanner
+// had to drop digits (truncated) or the literal has more than 15-16 significant digits.
+double decimalToDouble(uint64_t significand, int exponent, bool truncated, const char *lexeme, int length);
+
+#endif
@@ -0,0 +1,84 @@
+//
+// Created by neepoo on 23-3-14.
+//
+#include "memory.h"
+#include "nursery.h"
+#include "vm.h"
+
+#define NURSERY_ALIGNMENT 8
+// A string's header, then its characters and the '\0', padded so the next header is aligned.
+#define ENTRY_SIZE(length) \
+    ((sizeof(ObjString) + (size_t) (length) + 1 + NURSERY_ALIGNMENT - 1) & ~(size_t) (NURSERY_ALIGNMENT - 1))
+
+void initNursery(Nursery *nursery) {
+    nursery->start = NULL;
+    nursery->top = NULL;
+    nursery->end = NULL;
+    nursery->open = false;
+    nursery->strings = 0;
+    nursery->promoted = 0;
+}
+
+void freeNursery(Nursery *nursery) {
+    if (nursery->start != NULL) REALLOCATE_HEAP(MEM_NURSERY, nursery->start, NURSERY_BYTES, 0);
+    initNursery(nursery);
+}
+
+ObjString *allocateYoungString(Nursery *nursery, int length) {
+    if (!nursery->open || length >= NURSERY_MAX_STRING) return NULL;
+    if (nursery->start == NULL) {
+        nursery->start = (char *) REALLOCATE_HEAP(MEM_NURSERY, NULL, 0, NURSERY_BYTES);
+        nursery->top = nursery->start;
+        nursery->end = nursery->start + NURSERY_BYTES;
+    }
+    // What is in the nursery counts against the heap limit like anything else a script holds.
+    size_t size = ENTRY_SIZE(length);
+    if (size > (size_t) (nursery->end - nursery->top) || size > heapHeadroom()) return NULL;
+
+    ObjString *string = (ObjString *) nursery->top;
+    nursery->top += size;
+    vm.bytesAllocated += size;
+    string->obj.type = OBJ_STRING;
+    string->length = length;
+    string->chars = (char *) (string + 1);
+    nursery->strings++;
+    return string;
+}
+
+void dropYoungString(Nursery *nursery, ObjString *string) {
+    nursery->top = (char *) string;
+    vm.bytesAllocated -= ENTRY_SIZE(string->length);
+    nursery->strings--;
+}
+
+// A promoted string's chars point at its heap copy instead of just past its header.
+static bool isForwarded(ObjString const *string) {
+    return string->chars != (char const *) (string + 1);
+}
+
+void emptyNursery(Nursery *nursery, Value *roots, int rootCount) {
+    if (nursery->top == nursery->start) return;
+    for (int i = 0; i < rootCount; i++) {
+        if (!IS_OBJ(roots[i])) continue;
+        char *object = (char *) AS_OBJ(roots[i]);
+        if (object < nursery->start || object >= nursery->top) continue;
+        ObjString *young = (ObjString *) object;
+        if (!isForwarded(young)) {
+            young->chars = (char *) promoteString(young);
+            nursery->promoted++;
+        }
+        roots[i] = OBJ_VAL((ObjString *) young->chars);
+    }
+
+    // Everything else was only held by the intern table.
+    for (char *entry = nursery->start; entry < nursery->top;) {
+        ObjString *string = (ObjString *) entry;
+        if (!isForwarded(string)) tableDelete(&vm.strings, string);
+#ifdef CLOX_MEM_STATS
+        recordObject(OBJ_STRING, -1);
+#endif
+        entry += ENTRY_SIZE(string->length);
+    }
+    vm.bytesAllocated -= (size_t) (nursery->top - nursery->start);
+    nursery->top = nursery->start;
+}
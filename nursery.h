@@ -0,0 +1,50 @@
+//
+// Created by neepoo on 23-3-14.
+//
+
+#ifndef clox_nursery_h
+#define clox_nursery_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// The nursery's size, set aside the first time it is used.
+#define NURSERY_BYTES (256 * 1024)
+// A string this long or longer is made on the heap straight away rather than fill the nursery alone.
+#define NURSERY_MAX_STRING (NURSERY_BYTES / 8)
+
+/*
+ * Most strings concatenate() makes are read by the next instruction and never again. While a chunk runs
+ * they are bump allocated here instead, header and characters together, and interned as usual. When the
+ * chunk stops, emptyNursery() copies the few still referenced to the heap and forgets the rest: they
+ * leave the intern table, which holds nursery strings weakly, and the nursery is rewound in one step.
+ *
+ * A full nursery is not emptied in the middle of a run, since the top of the stack may be in a register
+ * or in the JIT's machine code; strings that do not fit are simply made on the heap.
+ */
+typedef struct {
+    char *start;  // NULL until the first string
+    char *top;
+    char *end;
+    bool open;  // a chunk is running outside the arena, so strings may be made here
+    size_t strings;  // made here, ever
+    size_t promoted;  // of those, copied to the heap
+} Nursery;
+
+void initNursery(Nursery *nursery);
+
+void freeNursery(Nursery *nursery);
+
+// Room for a string of length characters, with chars pointing just past the header, or NULL if the nursery
+// is closed, the string is too long or there is no room. The caller fills in the characters and the hash.
+ObjString *allocateYoungString(Nursery *nursery, int length);
+
+// Takes back the most recent allocateYoungString(), for a string that turned out to be interned already.
+void dropYoungString(Nursery *nursery, ObjString *string);
+
+// Copies every nursery string among roots to the heap, updating roots to point at the copies, then forgets
+// the others and rewinds the nursery.
+void emptyNursery(Nursery *nursery, Value *roots, int rootCount);
+
+#endif
@@ -14,15 +14,13 @@
     (type*)allocateObject(sizeof(type), objectType)
 
 static Obj *allocateObject(size_t size, ObjType type) {
-    Obj *object = (Obj *) reallocate(NULL, 0, size);
+    // Arena objects die with the arena all at once, so they are bump allocated there rather than put in
+    // the heap freeObjects() walks.
+    Obj *object = vm.inArena ? (Obj *) REALLOCATE(MEM_OBJECT, NULL, 0, size) : heapAllocate(&vm.heap, size);
     object->type = type;
-    /*
-     * Since this is a singly linked list, the easiest place to insert it is as the head.
-     * That way, we don’t need to also store a pointer to the tail and keep it updated.
-     * 先分配的对象在连表的尾部，后分配的对象在连表的头部
-     */
-    object->next = vm.objects;
-    vm.objects = object;
+#ifdef CLOX_MEM_STATS
+    recordObject(type, 1);
+#endif
     return object;
 }
 
@@ -32,19 +30,30 @@ static Obj *allocateObject(size_t size, ObjType type) {
 // the function that copies a string and
 // the one that takes ownership of an existing dynamically allocated string. We’ll start with the first.
 static ObjString *allocateString(char *chars, int length, uint32_t hash) {
+    // Nothing owns chars until the object exists, so if allocating it fails outOfMemory() frees them.
+    vm.looseChars = chars;
+    vm.looseLength = length;
     ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    vm.looseChars = NULL;
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(vm.inArena ? &vm.arenaStrings : &vm.strings, string, NIL_VAL);
     return string;
 }
 
+// During an arena evaluation a string may be interned in either table.
+static ObjString *findInterned(const char *chars, int length, uint32_t hash) {
+    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned == NULL && vm.inArena) interned = tableFindString(&vm.arenaStrings, chars, length, hash);
+    return interned;
+}
+
 // 字符串hash
 //This is the actual bona fide “hash function” in clox.
 // The algorithm is called “FNV-1a”, and is the shortest decent hash function I know.
 // Brevity is certainly a virtue in a book that aims to show you every line of code.
-static uint32_t hashString(const char *key, int length) {
+uint32_t hashString(const char *key, int length) {
     // ou start with some initial hash value, usually a constant with certain carefully chosen mathematical properties.
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
@@ -56,23 +65,40 @@ static uint32_t hashString(const char *key, int length) {
 
 ObjString *takeString(char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length,
-                                          hash);
+    ObjString *interned = findInterned(chars, length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY_AS(MEM_STRING_CHARS, char, chars, length + 1);
         return interned;
     }
     return allocateString(chars, length, hash);
 };
 
-ObjString *copyString(const char *chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString *internYoungString(ObjString *string) {
+    ObjString *interned = findInterned(string->chars, string->length, string->hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        dropYoungString(&vm.nursery, string);
         return interned;
     }
-    char *heapChars = ALLOCATE(char, length + 1);
+#ifdef CLOX_MEM_STATS
+    recordObject(OBJ_STRING, 1);
+#endif
+    tableSet(&vm.strings, string, NIL_VAL);
+    return string;
+}
+
+ObjString *promoteString(ObjString const *young) {
+    tableDelete(&vm.strings, (ObjString *) young);
+    char *heapChars = ALLOCATE_AS(MEM_STRING_CHARS, char, young->length + 1);
+    memcpy(heapChars, young->chars, young->length + 1);
+    return allocateString(heapChars, young->length, young->hash);
+}
+
+ObjString *copyString(const char *chars, int length) {
+    uint32_t hash = hashString(chars, length);
+    ObjString *interned = findInterned(chars, length, hash);
+    // The caller still owns chars (usually a pointer into the source), so there is nothing to free.
+    if (interned != NULL) return interned;
+    char *heapChars = ALLOCATE_AS(MEM_STRING_CHARS, char, length + 1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
     return allocateString(heapChars, length, hash);
@@ -84,4 +110,12 @@ void printObject(Value value) {
             printf("%s", AS_CSTRING(value));
             break;
     }
-};
\ No newline at end of file
+};
+
+void writeObject(Writer *writer, Value value) {
+    switch (OBJ_TYPE(value)) {
+        case OBJ_STRING:
+            writeChars(writer, AS_CSTRING(value), AS_STRING(value)->length);
+            break;
+    }
+}
\ No newline at end of file
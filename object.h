@@ -16,9 +16,11 @@ typedef enum {
     OBJ_STRING,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_STRING + 1)
+
+// Just the type: which objects exist is recorded by the heap's pages (heap.h), not by a list through them.
 struct Obj {
     ObjType type;
-    struct Obj *next;
 };
 
 struct ObjString {
@@ -32,8 +34,19 @@ ObjString *takeString(char *chars, int length);
 
 ObjString *copyString(const char *chars, int length);
 
+uint32_t hashString(const char *key, int length);
+
+// Like takeString(), for a string built in the nursery (nursery.h): if an equal string is interned already,
+// the new one is dropped and that one returned.
+ObjString *internYoungString(ObjString *string);
+
+// A heap copy of a nursery string, interned in its place.
+ObjString *promoteString(ObjString const *young);
+
 void printObject(Value value);
 
+void writeObject(Writer *writer, Value value);
+
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -0,0 +1,208 @@
+//
+// Created by neepoo on 23-3-12.
+//
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "vm.h"
+
+// Samples not yet attributed. The handler only stores offsets here; anything more is done after the
+// chunk has stopped, in attributeSamples().
+#define PENDING_CAPACITY (1 << 16)
+
+static int pending[PENDING_CAPACITY];  // offset of the byte vm.ip had just read
+static volatile sig_atomic_t pendingCount = 0;
+static volatile sig_atomic_t outside = 0;  // samples taken while no chunk was running
+static volatile sig_atomic_t dropped = 0;  // samples lost because pending was full
+
+typedef struct {
+    int line;
+    int opcode;
+} Sample;
+
+static Sample *samples = NULL;
+static int sampleCount = 0;
+static int sampleCapacity = 0;
+static FILE *collapsed = NULL;
+
+static void takeSample(int signal) {
+    (void) signal;
+    const Chunk *chunk = vm.chunk;
+    if (chunk == NULL) {
+        outside++;
+    } else if (pendingCount == PENDING_CAPACITY) {
+        dropped++;
+    } else {
+        pending[pendingCount] = (int) (vm.ip - chunk->code) - 1;
+        pendingCount++;
+    }
+}
+
+static bool setTimer(int interval) {
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = interval;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+bool startSampling(const char *collapsedPath) {
+    collapsed = fopen(collapsedPath, "w");
+    if (collapsed == NULL) {
+        fprintf(stderr, "Could not open \"%s\" for the collapsed stacks.\n", collapsedPath);
+        return false;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = takeSample;
+    // Interrupted reads carry on instead of failing.
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0 || !setTimer(SAMPLE_INTERVAL)) {
+        fprintf(stderr, "Could not start the sampling timer: %s\n", strerror(errno));
+        fclose(collapsed);
+        collapsed = NULL;
+        return false;
+    }
+    vm.sampling = true;
+    return true;
+}
+
+static void record(int line, int opcode) {
+    if (opcode >= OP_CONSTANT_0 && opcode <= OP_CONSTANT_15) opcode = OP_CONSTANT_0;
+    if (sampleCount == sampleCapacity) {
+        int oldCapacity = sampleCapacity;
+        sampleCapacity = GROW_CAPACITY(oldCapacity);
+        samples = GROW_HEAP_ARRAY(Sample, samples, oldCapacity, sampleCapacity);
+    }
+    samples[sampleCount].line = line;
+    samples[sampleCount].opcode = opcode;
+    sampleCount++;
+}
+
+static int compareOffsets(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+void attributeSamples(const Chunk *chunk) {
+    if (!vm.sampling) return;
+    // The handler must not add to pending while it is read and emptied.
+    sigset_t block;
+    sigset_t previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    sigprocmask(SIG_BLOCK, &block, &previous);
+
+    // In offset order, one walk over the code finds the instruction of every sample.
+    int count = pendingCount;
+    qsort(pending, (size_t) count, sizeof(int), compareOffsets);
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        // Before vm.ip is set, or after the chunk was swapped out, the offset means nothing here.
+        if (pending[i] < 0 || pending[i] >= chunk->count) {
+            outside++;
+            continue;
+        }
+        while (offset + instructionLength(chunk->code[offset]) <= pending[i]) {
+            offset += instructionLength(chunk->code[offset]);
+        }
+        record(chunk->lines[offset], chunk->code[offset]);
+    }
+    pendingCount = 0;
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+}
+
+static int compareSamples(const void *a, const void *b) {
+    const Sample *x = a;
+    const Sample *y = b;
+    if (x->line != y->line) return x->line - y->line;
+    return x->opcode - y->opcode;
+}
+
+typedef struct {
+    int key;  // a line or an opcode
+    int count;
+} Tally;
+
+static int compareTallies(const void *a, const void *b) {
+    const Tally *x = a;
+    const Tally *y = b;
+    if (x->count != y->count) return y->count - x->count;
+    return x->key - y->key;
+}
+
+// How many of the flat profile's lines are listed; the collapsed stacks have them all.
+#define TOP_LINES 20
+
+static void printTallies(FILE *report, const char *heading, Tally *tallies, int count, int total, bool lines) {
+    qsort(tallies, (size_t) count, sizeof(Tally), compareTallies);
+    fprintf(report, "  %s\n", heading);
+    int shown = lines && count > TOP_LINES ? TOP_LINES : count;
+    for (int i = 0; i < shown; i++) {
+        double percent = 100.0 * tallies[i].count / total;
+        if (lines) {
+            fprintf(report, "  %8d %6.2f%%  line %d\n", tallies[i].count, percent, tallies[i].key);
+        } else {
+            fprintf(report, "  %8d %6.2f%%  %s\n", tallies[i].count, percent, opcodeName((uint8_t) tallies[i].key));
+        }
+    }
+    if (shown < count) fprintf(report, "  (%d more lines)\n", count - shown);
+}
+
+void stopSampling(FILE *report) {
+    if (!vm.sampling) return;
+    setTimer(0);
+    signal(SIGPROF, SIG_DFL);
+    vm.sampling = false;
+
+    int total = sampleCount + outside;
+    qsort(samples, (size_t) sampleCount, sizeof(Sample), compareSamples);
+    // Sorted by line, then opcode: each run of equal samples is one collapsed stack.
+    Tally *lines = ALLOCATE_HEAP(Tally, sampleCount + 1);
+    int lineCount = 0;
+    Tally opcodes[256];
+    for (int i = 0; i < 256; i++) {
+        opcodes[i].key = i;
+        opcodes[i].count = 0;
+    }
+    for (int i = 0; i < sampleCount;) {
+        int run = i;
+        while (run < sampleCount && compareSamples(&samples[run], &samples[i]) == 0) run++;
+        fprintf(collapsed, "clox;line %d;%s %d\n", samples[i].line, opcodeName((uint8_t) samples[i].opcode), run - i);
+        if (lineCount == 0 || lines[lineCount - 1].key != samples[i].line) {
+            lines[lineCount].key = samples[i].line;
+            lines[lineCount].count = 0;
+            lineCount++;
+        }
+        lines[lineCount - 1].count += run - i;
+        opcodes[samples[i].opcode].count += run - i;
+        i = run;
+    }
+    if (outside > 0) fprintf(collapsed, "clox;(not running a chunk) %d\n", (int) outside);
+    fclose(collapsed);
+    collapsed = NULL;
+
+    fprintf(report, "== samples ==\n");
+    fprintf(report, "  %d samples, one every %dus of CPU time; %d outside any chunk, %d dropped\n", total,
+            SAMPLE_INTERVAL, (int) outside, (int) dropped);
+    if (sampleCount > 0) {
+        printTallies(report, "by line:", lines, lineCount, total, true);
+        // Only the opcodes that were seen.
+        int opcodeCount = 0;
+        for (int i = 0; i < 256; i++) {
+            if (opcodes[i].count > 0) opcodes[opcodeCount++] = opcodes[i];
+        }
+        printTallies(report, "by opcode:", opcodes, opcodeCount, total, false);
+    }
+    FREE_HEAP_ARRAY(Tally, lines, sampleCount + 1);
+    FREE_HEAP_ARRAY(Sample, samples, sampleCapacity);
+    samples = NULL;
+    sampleCount = 0;
+    sampleCapacity = 0;
+}
@@ -0,0 +1,34 @@
+//
+// Created by neepoo on 23-3-12.
+//
+
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+// How often a sample is taken, in microseconds of CPU time.
+#define SAMPLE_INTERVAL 1000
+
+/*
+ * --sample: a statistical profile. A SIGPROF timer records where vm.ip is; when a chunk stops running
+ * its samples are mapped to the instruction they fell in, and so to a source line and an opcode. Nothing
+ * is added to the interpreter loop. The JIT is left off while sampling, since its machine code does not
+ * keep vm.ip up to date.
+ *
+ * The flat profile (by line and by opcode) goes to stderr; the collapsed stacks, "clox;line 12;OP_ADD 34"
+ * per line, go to a file for flame graph tools.
+ */
+
+// Starts the timer. Returns false, after saying why, if the output file or the timer cannot be set up.
+bool startSampling(const char *collapsedPath);
+
+// Gives the samples taken since the last call to chunk, which has just stopped running.
+void attributeSamples(const Chunk *chunk);
+
+// Stops the timer and writes both reports.
+void stopSampling(FILE *report);
+
+#endif
@@ -5,25 +5,221 @@
 #include <string.h>
 
 #include "common.h"
+#include "number.h"
 #include "scanner.h"
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#define SCANNER_SIMD
+#include <immintrin.h>
+#endif
+
 typedef struct {
     const char *start;
     const char *current;
+    const char *end;  // one past the last character; nothing at or after it is ever read
     int line;// We have a line field to track what line the current lexeme is on for error reporting
 } Scanner;
 
 Scanner scanner;
 
+// The scanner spends most of its time in runs of whitespace, string bodies and identifiers.
+// Those runs are skipped by one of these kernels, which classify a whole block of bytes at a time.
+// Each returns the first byte that ends the run, or end; the whitespace and string kernels also
+// add the newlines they pass over to *lines.
+typedef struct {
+    const char *(*skipBlanks)(const char *current, const char *end, int *lines);
+    const char *(*findQuote)(const char *current, const char *end, int *lines);
+    const char *(*skipIdentifier)(const char *current, const char *end);
+} ScanKernels;
+
+static bool isBlank(char c) {
+    return c == ' ' || c == '\r' || c == '\t' || c == '\n';
+}
+
+static bool isIdentifierChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char *skipBlanksScalar(const char *current, const char *end, int *lines) {
+    while (current < end && isBlank(*current)) {
+        if (*current == '\n') (*lines)++;
+        current++;
+    }
+    return current;
+}
+
+static const char *findQuoteScalar(const char *current, const char *end, int *lines) {
+    while (current < end && *current != '"') {
+        if (*current == '\n') (*lines)++;
+        current++;
+    }
+    return current;
+}
+
+static const char *skipIdentifierScalar(const char *current, const char *end) {
+    while (current < end && isIdentifierChar(*current)) current++;
+    return current;
+}
+
+#ifdef SCANNER_SIMD
+
+// Bit i of the result describes byte i of the block. The block loops stop at the first block that
+// contains a byte ending the run, and leave anything shorter than a block to the scalar loops.
+
+static int countLines(unsigned newlines) {
+    return __builtin_popcount(newlines);
+}
+
+static unsigned blanksMask16(__m128i block, unsigned *newlines) {
+    __m128i newline = _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'));
+    __m128i blank = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), newline));
+    *newlines = (unsigned) _mm_movemask_epi8(newline);
+    return (unsigned) _mm_movemask_epi8(blank);
+}
+
+static const char *skipBlanksSse2(const char *current, const char *end, int *lines) {
+    while (end - current >= 16) {
+        unsigned newlines;
+        unsigned blanks = blanksMask16(_mm_loadu_si128((const __m128i *) current), &newlines);
+        if (blanks != 0xFFFF) {
+            int run = __builtin_ctz(~blanks);
+            *lines += countLines(newlines & ((1u << run) - 1));
+            return current + run;
+        }
+        *lines += countLines(newlines);
+        current += 16;
+    }
+    return skipBlanksScalar(current, end, lines);
+}
+
+static const char *findQuoteSse2(const char *current, const char *end, int *lines) {
+    while (end - current >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) current);
+        unsigned quotes = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+        unsigned newlines = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+        if (quotes != 0) {
+            int run = __builtin_ctz(quotes);
+            *lines += countLines(newlines & ((1u << run) - 1));
+            return current + run;
+        }
+        *lines += countLines(newlines);
+        current += 16;
+    }
+    return findQuoteScalar(current, end, lines);
+}
+
+// Signed byte compares are fine here: bytes >= 0x80 come out negative and so never look like letters.
+static unsigned identifierMask16(__m128i block) {
+    __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(block, _mm_set1_epi8('9' + 1)));
+    __m128i underscore = _mm_cmpeq_epi8(block, _mm_set1_epi8('_'));
+    return (unsigned) _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(letter, digit), underscore));
+}
+
+static const char *skipIdentifierSse2(const char *current, const char *end) {
+    while (end - current >= 16) {
+        unsigned chars = identifierMask16(_mm_loadu_si128((const __m128i *) current));
+        if (chars != 0xFFFF) return current + __builtin_ctz(~chars);
+        current += 16;
+    }
+    return skipIdentifierScalar(current, end);
+}
+
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+AVX2_TARGET static const char *skipBlanksAvx2(const char *current, const char *end, int *lines) {
+    while (end - current >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) current);
+        __m256i newline = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n'));
+        __m256i blank = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')),
+                                _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')), newline));
+        uint32_t blanks = (uint32_t) _mm256_movemask_epi8(blank);
+        uint32_t newlines = (uint32_t) _mm256_movemask_epi8(newline);
+        if (blanks != 0xFFFFFFFFu) {
+            int run = __builtin_ctz(~blanks);
+            *lines += __builtin_popcount(newlines & ((1u << run) - 1));
+            return current + run;
+        }
+        *lines += __builtin_popcount(newlines);
+        current += 32;
+    }
+    return skipBlanksSse2(current, end, lines);
+}
+
+AVX2_TARGET static const char *findQuoteAvx2(const char *current, const char *end, int *lines) {
+    while (end - current >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) current);
+        uint32_t quotes = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')));
+        uint32_t newlines = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+        if (quotes != 0) {
+            int run = __builtin_ctz(quotes);
+            *lines += __builtin_popcount(newlines & ((1u << run) - 1));
+            return current + run;
+        }
+        *lines += __builtin_popcount(newlines);
+        current += 32;
+    }
+    return findQuoteSse2(current, end, lines);
+}
+
+AVX2_TARGET static const char *skipIdentifierAvx2(const char *current, const char *end) {
+    while (end - current >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) current);
+        __m256i lower = _mm256_or_si256(block, _mm256_set1_epi8(0x20));
+        __m256i letter = _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8('a'), lower),
+                                             _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+        __m256i digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8('0'), block),
+                                            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), block));
+        __m256i underscore = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('_'));
+        uint32_t chars = (uint32_t) _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_or_si256(letter, digit), underscore));
+        if (chars != 0xFFFFFFFFu) return current + __builtin_ctz(~chars);
+        current += 32;
+    }
+    return skipIdentifierSse2(current, end);
+}
+
+#endif
+
+static ScanKernels kernels;
+
+static void selectKernels() {
+    if (kernels.skipBlanks != NULL) return;
+#ifdef SCANNER_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.skipBlanks = skipBlanksAvx2;
+        kernels.findQuote = findQuoteAvx2;
+        kernels.skipIdentifier = skipIdentifierAvx2;
+        return;
+    }
+    kernels.skipBlanks = skipBlanksSse2;
+    kernels.findQuote = findQuoteSse2;
+    kernels.skipIdentifier = skipIdentifierSse2;
+#else
+    kernels.skipBlanks = skipBlanksScalar;
+    kernels.findQuote = findQuoteScalar;
+    kernels.skipIdentifier = skipIdentifierScalar;
+#endif
+}
 
-void initScanner(const char *source) {
+void initScanner(const char *source, size_t length) {
+    selectKernels();
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + length;
     scanner.line = 1;
 };
 
 static bool isAtEnd() {
-    return *scanner.current == '\0';
+    return scanner.current == scanner.end;
 }
 // 返回当前字符，然后前进一格
 static char advance() {
@@ -56,12 +252,14 @@ static bool match(char expected) {
     return true;
 }
 
+// Both peeks pretend there is a '\0' at the end, so the source itself does not need one.
 static char peek() {
+    if (isAtEnd()) return '\0';
     return *scanner.current;
 }
 
 static char peekNext() {
-    if (isAtEnd()) return '\0';
+    if (scanner.end - scanner.current < 2) return '\0';
     return scanner.current[1];
 }
 
@@ -72,15 +270,14 @@ static void skipWhitespace() {
             case ' ':
             case '\r':
             case '\t':
-                advance();
-                break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner.current = kernels.skipBlanks(scanner.current, scanner.end, &scanner.line);
                 break;
             case '/': // comment
                 if (peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                    // memchr() is already a vectorized search for the end of the line.
+                    const char *newline = memchr(scanner.current, '\n', (size_t) (scanner.end - scanner.current));
+                    scanner.current = newline != NULL ? newline : scanner.end;
                 } else {
                     return;
                 }
@@ -93,10 +290,8 @@ static void skipWhitespace() {
 
 
 static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;  // supports multi-line strings.
-        advance();
-    }
+    // supports multi-line strings.
+    scanner.current = kernels.findQuote(scanner.current, scanner.end, &scanner.line);
     if (isAtEnd()) return errorToken("Unterminated string.");
 
     // The closing quote.
@@ -108,18 +303,43 @@ static bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
+// Past this many digits the significand could overflow, so the rest are only noted.
+#define SIGNIFICAND_LIMIT 1000000000000000000ull
+
+// The digits are accumulated as they are scanned, so the compiler never has to parse the lexeme again.
 static Token number() {
-    while (isDigit(peek())) advance();
+    // The first digit has already been consumed.
+    uint64_t significand = (uint64_t) (scanner.current[-1] - '0');
+    int exponent = 0;
+    bool truncated = false;
+    while (isDigit(peek())) {
+        if (significand < SIGNIFICAND_LIMIT) {
+            significand = significand * 10 + (uint64_t) (advance() - '0');
+        } else {
+            truncated = true;
+            advance();
+        }
+    }
 
     // Look for a fractional part.
     if (peek() == '.' && isDigit(peekNext())) {
         // Consume the "."
         advance();
 
-        while (isDigit(peek())) advance();
+        while (isDigit(peek())) {
+            if (significand < SIGNIFICAND_LIMIT) {
+                significand = significand * 10 + (uint64_t) (advance() - '0');
+                exponent--;
+            } else {
+                truncated = true;
+                advance();
+            }
+        }
     }
 
-    return makeToken(TOKEN_NUMBER);
+    Token token = makeToken(TOKEN_NUMBER);
+    token.number = decimalToDouble(significand, exponent, truncated, token.start, token.length);
+    return token;
 }
 
 static bool isAlpha(char c) {
@@ -187,7 +407,7 @@ static TokenType identifierType() {
 }
 
 static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+    scanner.current = kernels.skipIdentifier(scanner.current, scanner.end);
     return makeToken(identifierType());
 }
 
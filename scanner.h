@@ -5,6 +5,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stddef.h>
+
 typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
@@ -32,9 +34,11 @@ typedef struct {
     const char *start;
     int length;
     int line;
+    double number;  // the value of a TOKEN_NUMBER, computed while scanning it
 } Token;
 
-void initScanner(const char *source);
+// The source does not need a '\0' terminator; the scanner never reads past source + length.
+void initScanner(const char *source, size_t length);
 
 Token scanToken();
 
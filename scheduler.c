@@ -0,0 +1,137 @@
+//
+// Created by neepoo on 23-3-6.
+//
+#include <stdatomic.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "scheduler.h"
+
+void initScheduler(Scheduler *scheduler, int quantum) {
+    scheduler->queue = NULL;
+    scheduler->capacity = 0;
+    scheduler->head = 0;
+    scheduler->count = 0;
+    scheduler->quantum = quantum;
+    scheduler->spawned = 0;
+}
+
+void freeScheduler(Scheduler *scheduler) {
+    for (int i = 0; i < scheduler->count; i++) {
+        freeTask(scheduler->queue[(scheduler->head + i) % scheduler->capacity]);
+    }
+    FREE_ARRAY(Task *, scheduler->queue, scheduler->capacity);
+    initScheduler(scheduler, scheduler->quantum);
+}
+
+static void enqueue(Scheduler *scheduler, Task *task) {
+    if (scheduler->count == scheduler->capacity) {
+        // Unwrap the ring into the bigger array so head goes back to 0.
+        int oldCapacity = scheduler->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        Task **queue = ALLOCATE(Task *, capacity);
+        for (int i = 0; i < scheduler->count; i++) queue[i] = scheduler->queue[(scheduler->head + i) % oldCapacity];
+        FREE_ARRAY(Task *, scheduler->queue, oldCapacity);
+        scheduler->queue = queue;
+        scheduler->capacity = capacity;
+        scheduler->head = 0;
+    }
+    scheduler->queue[(scheduler->head + scheduler->count) % scheduler->capacity] = task;
+    scheduler->count++;
+}
+
+static Task *dequeue(Scheduler *scheduler) {
+    Task *task = scheduler->queue[scheduler->head];
+    scheduler->head = (scheduler->head + 1) % scheduler->capacity;
+    scheduler->count--;
+    return task;
+}
+
+Task *spawnTask(Scheduler *scheduler, const char *source, size_t length) {
+    // Tasks outlive the evaluation an arena would be reset after.
+    bool inArena = vm.inArena;
+    vm.inArena = false;
+    Task *task = ALLOCATE(Task, 1);
+    // A source that does not compile still uses up its id, so ids stay in step with the sources.
+    task->id = scheduler->spawned++;
+    initChunk(&task->compiled);
+    task->chunk = findPreloadedChunk(&vm.image, source, length);
+    if (task->chunk == NULL) {
+        if (!compile(source, length, &task->compiled)) {
+            freeChunk(&task->compiled);
+            FREE(Task, task);
+            vm.inArena = inArena;
+            return NULL;
+        }
+        task->chunk = &task->compiled;
+    }
+    task->ip = task->chunk->code;
+    // Every register of a suspended task is looked at when the nursery is emptied, so none may be garbage.
+    Value *slots = ALLOCATE(Value, task->chunk->maxStack + 1);
+    for (int i = 0; i <= task->chunk->maxStack; i++) slots[i] = NIL_VAL;
+    task->stack = slots + 1;
+    task->stackTop = task->stack;
+    initWriter(&task->out, NULL);
+    task->result = INTERPRET_SUSPENDED;
+    enqueue(scheduler, task);
+    vm.inArena = inArena;
+    return task;
+}
+
+void freeTask(Task *task) {
+    // Before freeChunk(), which zeroes the maxStack the stack was sized by.
+    FREE_ARRAY(Value, task->stack - 1, task->chunk->maxStack + 1);
+    freeChunk(&task->compiled);
+    freeWriter(&task->out);
+    FREE(Task, task);
+}
+
+// Swaps the task's state into the VM, runs it, and swaps it back out. The VM's own stack and output are
+// left exactly as they were. The sampling timer reads vm.ip against vm.chunk at any moment, so vm.chunk is
+// cleared while vm.ip moves to another chunk. The two are plain fields, which the compiler may reorder,
+// merge or drop stores to; the signal fences keep each store in place as the handler sees it.
+static void resumeTask(Task *task, int quantum) {
+    Chunk *chunk = vm.chunk;
+    uint8_t *ip = vm.ip;
+    Value *stack = vm.stack;
+    int stackCapacity = vm.stackCapacity;
+    Value *stackTop = vm.stackTop;
+    Writer out = vm.out;
+
+    vm.chunk = NULL;
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.ip = task->ip;
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.chunk = task->chunk;
+    vm.stack = task->stack;
+    vm.stackCapacity = task->chunk->maxStack;
+    vm.stackTop = task->stackTop;
+    vm.out = task->out;
+    task->result = resumeChunk(task->stack, quantum);
+    task->ip = vm.ip;
+    task->stackTop = vm.stackTop;
+    task->out = vm.out;
+
+    vm.chunk = NULL;
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.ip = ip;
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.chunk = chunk;
+    vm.stack = stack;
+    vm.stackCapacity = stackCapacity;
+    vm.stackTop = stackTop;
+    vm.out = out;
+}
+
+bool runSlice(Scheduler *scheduler, Task **finished) {
+    *finished = NULL;
+    if (scheduler->count == 0) return false;
+    Task *task = dequeue(scheduler);
+    resumeTask(task, scheduler->quantum);
+    if (task->result == INTERPRET_SUSPENDED) {
+        enqueue(scheduler, task);
+    } else {
+        *finished = task;
+    }
+    return true;
+}
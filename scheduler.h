@@ -0,0 +1,54 @@
+//
+// Created by neepoo on 23-3-6.
+//
+
+#ifndef clox_scheduler_h
+#define clox_scheduler_h
+
+#include "chunk.h"
+#include "vm.h"
+#include "writer.h"
+
+// A suspended evaluation: its chunk, where it stopped, and a stack of its own to stop with.
+typedef struct {
+    int id;  // the number of spawnTask() calls before this one
+    Chunk compiled;  // the task's own chunk, unless it is running one from the heap image
+    Chunk *chunk;
+    uint8_t *ip;
+    Value *stack;  // chunk->maxStack slots above a spare one, laid out like vm.stack
+    Value *stackTop;
+    Writer out;  // the result, once the task has finished
+    InterpretResult result;  // INTERPRET_SUSPENDED until it has finished
+} Task;
+
+/*
+ * Round-robin over many evaluations on one thread. Each turn the task at the front of the queue runs for
+ * at most quantum instructions and, unless it finished, goes to the back. A handful of huge expressions
+ * then only slow everything else down in proportion, instead of holding up whatever is queued behind them.
+ *
+ * Tasks compile outside arena mode and allocate from the heap, since they outlive any one evaluation.
+ */
+typedef struct {
+    Task **queue;  // a ring buffer
+    int capacity;
+    int head;
+    int count;
+    int quantum;
+    int spawned;
+} Scheduler;
+
+void initScheduler(Scheduler *scheduler, int quantum);
+
+// Frees the tasks still queued.
+void freeScheduler(Scheduler *scheduler);
+
+// Compiles source (or finds it in the heap image) and queues it. Returns NULL after a compile error.
+Task *spawnTask(Scheduler *scheduler, const char *source, size_t length);
+
+// Gives the front task one quantum. Returns false if the queue is empty. If the task finished it is
+// handed back in *finished, with its result and output, for the caller to free; otherwise *finished is NULL.
+bool runSlice(Scheduler *scheduler, Task **finished);
+
+void freeTask(Task *task);
+
+#endif
@@ -0,0 +1,239 @@
+//
+// Created by neepoo on 23-3-8.
+//
+// accept4() is a GNU extension.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+
+#include "serve.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "vm.h"
+
+#define MAX_EVENTS 64
+// A request longer than this is taken as a broken client rather than buffered.
+#define MAX_REQUEST (16 * 1024 * 1024)
+#define READ_SIZE (64 * 1024)
+
+typedef struct {
+    int fd;
+    Writer in;  // received bytes not yet handled, starting at a length prefix
+    Writer out;  // responses not yet sent
+    int sent;  // how much of out has been sent
+} Client;
+
+static int epoll;
+// A descriptor held back so a connection can still be accepted, and closed, when there are no others.
+static int spare;
+
+// A client is either reading requests or, while a response is only partly sent, waiting to write.
+// It is not read from meanwhile, so one that never reads its responses cannot make the server buffer
+// without end.
+static bool watch(Client *client, int operation, uint32_t events) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = client;
+    return epoll_ctl(epoll, operation, client->fd, &event) == 0;
+}
+
+static void closeClient(Client *client) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    freeWriter(&client->in);
+    freeWriter(&client->out);
+    FREE_HEAP_ARRAY(Client, client, 1);
+}
+
+static void writeLength(Writer *writer, uint32_t length) {
+    char bytes[4] = {(char) (length >> 24), (char) (length >> 16), (char) (length >> 8), (char) length};
+    writeChars(writer, bytes, 4);
+}
+
+static uint32_t readLength(const char *chars) {
+    const unsigned char *bytes = (const unsigned char *) chars;
+    return (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | bytes[3];
+}
+
+// Runs one request the way interpret() would and queues the response. vm.out and vm.err have no file
+// while serving, so they just collect what this evaluation prints.
+static void evaluate(Client *client, const char *source, size_t length) {
+    vm.out.count = 0;
+    vm.err.count = 0;
+    InterpretResult result = interpretLength(source, length);
+    Writer const *reply = result == INTERPRET_OK ? &vm.out : &vm.err;
+    writeLength(&client->out, (uint32_t) reply->count + 1);
+    writeChar(&client->out, (char) result);
+    writeChars(&client->out, reply->chars, reply->count);
+}
+
+// Sends as much of the queued output as the socket takes. Returns false if the client is gone.
+static bool sendOutput(Client *client) {
+    while (client->sent < client->out.count) {
+        ssize_t sent = send(client->fd, client->out.chars + client->sent, (size_t) (client->out.count - client->sent),
+                            MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (sent <= 0) return false;
+        client->sent += (int) sent;
+    }
+    client->out.count = 0;
+    client->sent = 0;
+    return true;
+}
+
+// Evaluates every complete request in the input buffer, unless output is still waiting to go, then
+// sends the responses. Returns false if the client has to be dropped.
+static bool handleRequests(Client *client) {
+    int handled = 0;
+    while (client->out.count == 0 && client->in.count - handled >= 4) {
+        uint32_t length = readLength(client->in.chars + handled);
+        if (length > MAX_REQUEST) return false;
+        if ((uint32_t) (client->in.count - handled - 4) < length) break;
+        evaluate(client, client->in.chars + handled + 4, length);
+        handled += 4 + (int) length;
+        if (!sendOutput(client)) return false;
+    }
+    if (handled > 0) {
+        memmove(client->in.chars, client->in.chars + handled, (size_t) (client->in.count - handled));
+        client->in.count -= handled;
+    }
+    return watch(client, EPOLL_CTL_MOD, client->out.count > 0 ? EPOLLOUT : EPOLLIN);
+}
+
+static bool receive(Client *client) {
+    char buffer[READ_SIZE];
+    for (;;) {
+        ssize_t received = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (received <= 0) return false;
+        writeChars(&client->in, buffer, (int) received);
+        if (client->in.count > MAX_REQUEST + 4) break;
+    }
+    return handleRequests(client);
+}
+
+static void acceptClients(int listener) {
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // Out of descriptors. The listener is level triggered, so a connection left in the backlog
+            // would wake epoll_wait() again straight away and the server would spin; it is turned away
+            // instead, through the spare descriptor.
+            if ((errno == EMFILE || errno == ENFILE) && spare >= 0) {
+                close(spare);
+                int turnedAway = accept(listener, NULL, NULL);
+                if (turnedAway >= 0) close(turnedAway);
+                spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                // accept4() fails with EMFILE before it looks at the backlog, so this only goes on while
+                // there was someone to turn away.
+                if (turnedAway < 0) return;
+                continue;
+            }
+            // EAGAIN: no one else is waiting.
+            return;
+        }
+        Client *client = ALLOCATE_HEAP(Client, 1);
+        client->fd = fd;
+        initWriter(&client->in, NULL);
+        initWriter(&client->out, NULL);
+        client->sent = 0;
+        if (!watch(client, EPOLL_CTL_ADD, EPOLLIN)) closeClient(client);
+    }
+}
+
+static int listenOn(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by an earlier server is replaced; any other file is not touched.
+    struct stat info;
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s\n", path, strerror(errno));
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+int serve(const char *path) {
+    int listener = listenOn(path);
+    if (listener < 0) return 74;
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;  // the listener; every client has its Client here
+    if (epoll < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) != 0) {
+        fprintf(stderr, "Could not set up epoll: %s\n", strerror(errno));
+        close(listener);
+        return 74;
+    }
+    spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare < 0) {
+        fprintf(stderr, "Could not open /dev/null: %s\n", strerror(errno));
+        close(listener);
+        return 74;
+    }
+
+    flushWriter(&vm.out);
+    freeWriter(&vm.out);
+    initWriter(&vm.out, NULL);
+    freeWriter(&vm.err);
+    initWriter(&vm.err, NULL);
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int count = epoll_wait(epoll, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            return 74;
+        }
+        for (int i = 0; i < count; i++) {
+            Client *client = events[i].data.ptr;
+            if (client == NULL) {
+                acceptClients(listener);
+                continue;
+            }
+            bool open;
+            if (events[i].events & EPOLLOUT) {
+                open = sendOutput(client) && (client->out.count > 0 || handleRequests(client));
+            } else {
+                open = receive(client);
+            }
+            if (!open) closeClient(client);
+        }
+    }
+}
+
+#else
+
+int serve(const char *path) {
+    fprintf(stderr, "Could not serve on \"%s\": --serve needs Linux (epoll).\n", path);
+    return 70;
+}
+
+#endif
@@ -0,0 +1,21 @@
+//
+// Created by neepoo on 23-3-8.
+//
+
+#ifndef clox_serve_h
+#define clox_serve_h
+
+/*
+ * clox --serve <socket>: one warm process answers evaluations over a Unix domain socket, so a caller
+ * pays neither the process start nor the cold vm.strings table on each one.
+ *
+ * Every message, either way, is a 4-byte big-endian length followed by that many bytes. A request is the
+ * source of one expression. The response starts with one status byte, an InterpretResult, followed by what
+ * the evaluation printed for INTERPRET_OK or its error messages otherwise. A client may send any number of
+ * requests on one connection and gets the responses back in the same order.
+ */
+
+// Serves until the process is killed. Returns an exit status if the socket cannot be set up.
+int serve(const char *path);
+
+#endif
@@ -24,7 +24,7 @@ void initTable(Table *table) {
 }
 
 void freeTable(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY_AS(MEM_TABLE_ENTRIES, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
@@ -60,7 +60,7 @@ Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
 //Before we can put entries in the hash table, we do need a place to actually store them. We need to allocate an array of buckets.
 static void adjustCapacity(Table *table, int capacity) {
     // 如果满了，底层调用realloc（NULL）
-    Entry *entries = ALLOCATE(Entry, capacity);
+    Entry *entries = ALLOCATE_AS(MEM_TABLE_ENTRIES, Entry, capacity);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
@@ -82,7 +82,7 @@ static void adjustCapacity(Table *table, int capacity) {
         table->count++;
     }
     // After that’s done, we can release the memory for the old array.
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY_AS(MEM_TABLE_ENTRIES, Entry, table->entries, table->capacity);
 
     table->entries = entries;
     table->capacity = capacity;
@@ -7,6 +7,7 @@
 
 #include "object.h"
 #include "memory.h"
+#include "number.h"
 #include "value.h"
 
 void initValueArray(ValueArray *array) {
@@ -19,14 +20,14 @@ void writeValueArray(ValueArray *array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY_AS(MEM_CONSTANTS, Value, array->values, oldCapacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
 void freeValueArray(ValueArray *array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    FREE_ARRAY_AS(MEM_CONSTANTS, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
@@ -38,15 +39,41 @@ void printValue(Value value) {
         case VAL_NIL:
             printf("nil");
             break;
-        case VAL_NUMBER:
-            printf("%g", AS_NUMBER(value));
+        case VAL_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            fwrite(buffer, sizeof(char), (size_t) formatNumber(AS_NUMBER(value), buffer), stdout);
             break;
+        }
         case VAL_OBJ:
             printObject(value);
             break;
     }
 }
 
+// The same as printValue(), but into a Writer, so printing a result costs a memcpy rather than a printf().
+void writeValue(Writer *writer, Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            if (AS_BOOL(value)) {
+                writeChars(writer, "true", 4);
+            } else {
+                writeChars(writer, "false", 5);
+            }
+            break;
+        case VAL_NIL:
+            writeChars(writer, "nil", 3);
+            break;
+        case VAL_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            writeChars(writer, buffer, formatNumber(AS_NUMBER(value), buffer));
+            break;
+        }
+        case VAL_OBJ:
+            writeObject(writer, value);
+            break;
+    }
+}
+
 
 bool valuesEqual(Value a, Value b) {
     if (a.type != b.type) return false;
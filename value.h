@@ -5,6 +5,7 @@
 #define clox_value_h
 
 #include "common.h"
+#include "writer.h"
 
 typedef struct Obj Obj;
 
@@ -59,4 +60,6 @@ void freeValueArray(ValueArray *array);
 
 void printValue(Value value);
 
+void writeValue(Writer *writer, Value value);
+
 #endif
@@ -2,15 +2,20 @@
 // Created by neepoo on 23-1-6.
 //
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "debug.h"
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 
 VM vm;
 
@@ -18,66 +23,211 @@ static void resetStack() {
     vm.stackTop = vm.stack;
 }
 
+static void reportRuntimeError(int line, const char *format, va_list args) {
+    writeFormatV(&vm.err, format, args);
+    writeFormat(&vm.err, "\n[line %d] in script\n", line);
+    flushWriter(&vm.err);
+    resetStack();
+}
+
 static void runtimeError(const char *format, ...) {
+    size_t instruction = vm.ip - vm.chunk->code - 1;
+    int line = vm.chunk->lines[instruction];
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    reportRuntimeError(line, format, args);
     va_end(args);
-    fputs("\n", stderr);
+}
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+void runtimeErrorAt(int line, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportRuntimeError(line, format, args);
+    va_end(args);
 }
 
 void initVM() {
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
     resetStack();
-    vm.objects = NULL;
+    initHeap(&vm.heap);
+    initNursery(&vm.nursery);
     initTable(&vm.strings);
+    initWriter(&vm.out, stdout);
+    initWriter(&vm.err, stderr);
+    vm.arenaMode = false;
+    vm.inArena = false;
+    initArena(&vm.arena);
+    initTable(&vm.arenaStrings);
+    initImage(&vm.image);
+    initChunkCache(&vm.cache);
+    vm.chunk = NULL;
+    vm.sampling = false;
+    vm.heapLimit = 0;
+    vm.bytesAllocated = 0;
+    vm.errorJump = NULL;
+    vm.looseChars = NULL;
+    vm.looseLength = 0;
 };
 
 void freeVM() {
+    flushWriter(&vm.out);
+    freeWriter(&vm.out);
+    freeWriter(&vm.err);
+    if (vm.stack != NULL) FREE_HEAP_ARRAY_AS(MEM_STACK, Value, vm.stack - 1, vm.stackCapacity + 1);
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
     freeTable(&vm.strings);
     freeObjects();
+    freeNursery(&vm.nursery);
+    freeArena(&vm.arena);
+    freeImage(&vm.image);
+    freeChunkCache(&vm.cache);
 };
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+void setArenaMode(bool enabled) {
+    vm.arenaMode = enabled;
+}
+
+void setChunkCacheCapacity(int capacity) {
+    resizeChunkCache(&vm.cache, capacity);
+}
+
+void setHeapLimit(size_t bytes) {
+    vm.heapLimit = bytes;
+}
+
+size_t heapHeadroom() {
+    if (vm.heapLimit == 0 || vm.errorJump == NULL) return SIZE_MAX;
+    size_t used = vm.bytesAllocated + vm.arena.blockBytes;
+    return used >= vm.heapLimit ? 0 : vm.heapLimit - used;
+}
+
+void outOfMemory() {
+    if (vm.errorJump == NULL) exit(1);
+    if (vm.looseChars != NULL) {
+        FREE_ARRAY_AS(MEM_STRING_CHARS, char, vm.looseChars, vm.looseLength + 1);
+        vm.looseChars = NULL;
+    }
+    if (vm.heapLimit != 0) {
+        runtimeError("Out of memory: the heap limit is %zu bytes.", vm.heapLimit);
+    } else {
+        runtimeError("Out of memory.");
+    }
+    longjmp(*vm.errorJump, 1);
+}
+
+static void beginArena() {
+    vm.inArena = true;
+}
+
+// Arena strings live only in the arena and vm.arenaStrings, so forgetting that table and
+// rewinding the arena is all it takes.
+static void endArena() {
+    vm.inArena = false;
+    initTable(&vm.arenaStrings);
+    resetArena(&vm.arena);
+}
+
+Value retainValue(Value value) {
+    if (!vm.inArena || !IS_STRING(value) || !arenaOwns(&vm.arena, AS_OBJ(value))) return value;
+    ObjString *string = AS_STRING(value);
+    // Later lookups in this evaluation must find the heap copy, or equal strings would stop being identical.
+    tableDelete(&vm.arenaStrings, string);
+    vm.inArena = false;
+    ObjString *retained = copyString(string->chars, string->length);
+    vm.inArena = true;
+    return OBJ_VAL(retained);
+}
+
+// The compiler has already worked out how deep the chunk's stack goes, so one check here
+// replaces a bounds check on every push.
+static void ensureStack(int needed) {
+    if (needed <= vm.stackCapacity) return;
+    int oldSlots = vm.stack == NULL ? 0 : vm.stackCapacity + 1;
+    ptrdiff_t height = vm.stackTop - vm.stack;
+    while (vm.stackCapacity < needed) vm.stackCapacity = GROW_CAPACITY(vm.stackCapacity);
+    // One spare slot sits below vm.stack[0], so run() can spill its cached top even when the stack is empty.
+    Value *slots = GROW_HEAP_ARRAY_AS(MEM_STACK, Value, vm.stack == NULL ? NULL : vm.stack - 1, oldSlots, vm.stackCapacity + 1);
+    slots[0] = NIL_VAL;
+    vm.stack = slots + 1;
+    vm.stackTop = vm.stack + height;
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString const *b = AS_STRING(pop());
-    ObjString const *a = AS_STRING(pop());
+Value concatenate(ObjString const *a, ObjString const *b) {
     int length = b->length + a->length;
-    char *chars = ALLOCATE(char, length + 1);
+    ObjString *young = allocateYoungString(&vm.nursery, length);
+    if (young != NULL) {
+        memcpy(young->chars, a->chars, a->length);
+        memcpy(young->chars + a->length, b->chars, b->length);
+        young->chars[length] = '\0';
+        young->hash = hashString(young->chars, length);
+        return OBJ_VAL(internYoungString(young));
+    }
+    char *chars = ALLOCATE_AS(MEM_STRING_CHARS, char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
     ObjString const *result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    return OBJ_VAL(result);
 }
 
-static InterpretResult run() {
+// Runs vm.chunk from vm.ip. frame is where the chunk's stack starts: vm.stackTop on the first call, the
+// same slot again when a suspended run is resumed. After budget instructions it syncs the stack and
+// returns INTERPRET_SUSPENDED, so the state is all in vm.ip and the stack for the next call.
+static InterpretResult run(Value *frame, int budget) {
+    // The top of the stack is kept in a local so arithmetic chains stay in registers. topSlot is where
+    // top belongs in vm.stack; everything below it is in memory as usual. vm.stackTop is only brought
+    // up to date (SYNC_STACK) when something outside this function is about to look at the stack.
+    Value *topSlot = vm.stackTop - 1;
+    Value top = *topSlot;
+    // frame[0] is slot 0 of OP_RESERVE's saved values.
+    Value const *constants = vm.chunk->constants.values;
 #define READ_BYTE() (*vm.ip++)  // 先解引用，然后ip在++
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define SYNC_STACK() (*topSlot = top, vm.stackTop = topSlot + 1)
+#define QUICKEN(op) (vm.ip[-1] = (op))
+// Put the generic instruction back and dispatch it again.
+#define DEOPTIMIZE(op) \
+    do { \
+      vm.ip[-1] = (op); \
+      vm.ip--; \
+    } while (false)
+#define PUSH(value) \
+    do { \
+      *topSlot++ = top; \
+      top = (value); \
+    } while (false)
+// For operands the compiler has proven to be numbers.
+#define NUMBER_OP(valueType, op) \
+    do { \
+      double b = AS_NUMBER(top); \
+      double a = AS_NUMBER(*--topSlot); \
+      top = valueType(a op b); \
+    } while (false)
 #define BINARY_OP(valueType, op) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      if (!IS_NUMBER(top) || !IS_NUMBER(topSlot[-1])) { \
+        SYNC_STACK(); \
         runtimeError("Operands must be numbers."); \
         return INTERPRET_RUNTIME_ERROR; \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(top); \
+      double a = AS_NUMBER(*--topSlot); \
+      top = valueType(a op b); \
     } while (false)
 
     for (;;) {
+        if (budget-- == 0) {
+            SYNC_STACK();
+            return INTERPRET_SUSPENDED;
+        }
 #ifdef DEBUG_TRACE_EXECUTION
+        SYNC_STACK();
         printf("        ");
         for (Value const *slot = vm.stack; slot < vm.stackTop; slot++) {
             printf("[ ");
@@ -96,13 +246,18 @@ static InterpretResult run() {
                 BINARY_OP(BOOL_VAL, <);
                 break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                Value b = top;
+                Value a = topSlot[-1];
+                if (IS_STRING(b) && IS_STRING(a)) {
+                    QUICKEN(OP_ADD_STR);
+                    topSlot--;
+                    top = concatenate(AS_STRING(a), AS_STRING(b));
+                } else if (IS_NUMBER(b) && IS_NUMBER(a)) {
+                    QUICKEN(OP_ADD_NUM);
+                    topSlot--;
+                    top = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
                 } else {
+                    SYNC_STACK();
                     runtimeError("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
@@ -121,67 +276,456 @@ static InterpretResult run() {
                 break;
             }
             case OP_NOT: {
-                push(BOOL_VAL(isFalsey(pop())));
+                top = BOOL_VAL(isFalsey(top));
                 break;
             }
             case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
+                if (!IS_NUMBER(top)) {
+                    SYNC_STACK();
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                top = NUMBER_VAL(-AS_NUMBER(top));
                 break;
             }
             case OP_RETURN: {
-                printValue(pop());
-                printf("\n");
+                // Drop the result along with any saved subexpressions below it.
+                Value result = top;
+                topSlot = frame - 1;
+                top = *topSlot;
+                SYNC_STACK();
+                writeValue(&vm.out, result);
+                writeChar(&vm.out, '\n');
                 return INTERPRET_OK;
             }
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
-                push(constant);
+                PUSH(constant);
                 break;
             }
             case OP_NIL:
-                push(NIL_VAL);
+                PUSH(NIL_VAL);
                 break;
             case OP_TRUE:
-                push(BOOL_VAL(true));
+                PUSH(BOOL_VAL(true));
                 break;
             case OP_FALSE:
-                push(BOOL_VAL(false));
+                PUSH(BOOL_VAL(false));
                 break;
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                Value b = top;
+                Value a = *--topSlot;
+                if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(OP_EQUAL_NUM);
+                top = BOOL_VAL(valuesEqual(a, b));
+                break;
+            }
+            case OP_ADD_NUM: {
+                if (!IS_NUMBER(top) || !IS_NUMBER(topSlot[-1])) {
+                    DEOPTIMIZE(OP_ADD);
+                    break;
+                }
+                double b = AS_NUMBER(top);
+                double a = AS_NUMBER(*--topSlot);
+                top = NUMBER_VAL(a + b);
                 break;
             }
+            case OP_ADD_STR: {
+                if (!IS_STRING(top) || !IS_STRING(topSlot[-1])) {
+                    DEOPTIMIZE(OP_ADD);
+                    break;
+                }
+                ObjString const *b = AS_STRING(top);
+                ObjString const *a = AS_STRING(*--topSlot);
+                top = concatenate(a, b);
+                break;
+            }
+            case OP_EQUAL_NUM: {
+                // Saves the call to valuesEqual() and its switch on the type.
+                if (!IS_NUMBER(top) || !IS_NUMBER(topSlot[-1])) {
+                    DEOPTIMIZE(OP_EQUAL);
+                    break;
+                }
+                double b = AS_NUMBER(top);
+                double a = AS_NUMBER(*--topSlot);
+                top = BOOL_VAL(a == b);
+                break;
+            }
+            case OP_FADD:
+                NUMBER_OP(NUMBER_VAL, +);
+                break;
+            case OP_FSUBTRACT:
+                NUMBER_OP(NUMBER_VAL, -);
+                break;
+            case OP_FMULTIPLY:
+                NUMBER_OP(NUMBER_VAL, *);
+                break;
+            case OP_FDIVIDE:
+                NUMBER_OP(NUMBER_VAL, /);
+                break;
+            case OP_FGREATER:
+                NUMBER_OP(BOOL_VAL, >);
+                break;
+            case OP_FLESS:
+                NUMBER_OP(BOOL_VAL, <);
+                break;
+            case OP_FEQUAL:
+                NUMBER_OP(BOOL_VAL, ==);
+                break;
+            case OP_FNEGATE:
+                top = NUMBER_VAL(-AS_NUMBER(top));
+                break;
+            case OP_CONCAT: {
+                ObjString const *b = AS_STRING(top);
+                ObjString const *a = AS_STRING(*--topSlot);
+                top = concatenate(a, b);
+                break;
+            }
+            case OP_RESERVE: {
+                int count = READ_BYTE();
+                for (int i = 0; i < count; i++) PUSH(NIL_VAL);
+                break;
+            }
+            case OP_STORE_SLOT:
+                frame[READ_BYTE()] = top;
+                break;
+            case OP_LOAD_SLOT:
+                // Saved values sit below everything computed after them, so they are never held in top.
+                PUSH(frame[READ_BYTE()]);
+                break;
+            case OP_DUP:
+                PUSH(top);
+                break;
+            case OP_SMALLINT:
+                PUSH(NUMBER_VAL((int8_t) READ_BYTE()));
+                break;
+            CASE_SHORT_CONSTANTS:
+                PUSH(constants[instruction - OP_CONSTANT_0]);
+                break;
         }
     }
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef SYNC_STACK
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef PUSH
+#undef NUMBER_OP
+#undef BINARY_OP
+}
+
+// The interpreter for register code (chunk->registers). The chunk's registers are the maxStack slots
+// starting at registers, the top of the stack when it starts. Suspends and resumes like run().
+static InterpretResult runRegisters(Value *registers, int budget) {
+    Value const *constants = vm.chunk->constants.values;
+    vm.stackTop = registers + vm.chunk->maxStack;
+#ifdef DEBUG_TRACE_EXECUTION
+    // Every register is written before it is read, but the trace prints them all.
+    if (vm.ip == vm.chunk->code) {
+        for (int i = 0; i < vm.chunk->maxStack; i++) registers[i] = NIL_VAL;
+    }
+#endif
+#define READ_BYTE() (*vm.ip++)
+#define READ_RK() (rk = READ_BYTE(), rk < RK_CONSTANT ? registers[rk] : constants[rk - RK_CONSTANT])
+// Reads the destination and both operands of a three-address instruction.
+#define READ_OPERANDS() \
+    do { \
+      dst = &registers[READ_BYTE()]; \
+      a = READ_RK(); \
+      b = READ_RK(); \
+    } while (false)
+#define NUMBER_OP(valueType, op) \
+    do { \
+      READ_OPERANDS(); \
+      *dst = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+#define BINARY_OP(valueType, op) \
+    do { \
+      READ_OPERANDS(); \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        runtimeError("Operands must be numbers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      *dst = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+    Value *dst;
+    Value a;
+    Value b;
+    uint8_t rk;
+    for (;;) {
+        if (budget-- == 0) return INTERPRET_SUSPENDED;
+#ifdef DEBUG_TRACE_EXECUTION
+        printf("        ");
+        for (Value const *slot = vm.stack; slot < vm.stackTop; slot++) {
+            printf("[ ");
+            printValue(*slot);
+            printf(" ]");
+        }
+        printf("\n");
+        disassembleInstruction(vm.chunk, (int) (vm.ip - vm.chunk->code));
+#endif
+        switch (READ_BYTE()) {
+            case OP_R_LOADK:
+                dst = &registers[READ_BYTE()];
+                *dst = constants[READ_BYTE()];
+                break;
+            case OP_R_ADD:
+                READ_OPERANDS();
+                if (IS_STRING(a) && IS_STRING(b)) {
+                    *dst = concatenate(AS_STRING(a), AS_STRING(b));
+                } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    *dst = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                } else {
+                    runtimeError("Operands must be two numbers or two strings.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            case OP_R_SUBTRACT:
+                BINARY_OP(NUMBER_VAL, -);
+                break;
+            case OP_R_MULTIPLY:
+                BINARY_OP(NUMBER_VAL, *);
+                break;
+            case OP_R_DIVIDE:
+                BINARY_OP(NUMBER_VAL, /);
+                break;
+            case OP_R_GREATER:
+                BINARY_OP(BOOL_VAL, >);
+                break;
+            case OP_R_LESS:
+                BINARY_OP(BOOL_VAL, <);
+                break;
+            case OP_R_EQUAL:
+                READ_OPERANDS();
+                *dst = BOOL_VAL(valuesEqual(a, b));
+                break;
+            case OP_R_FADD:
+                NUMBER_OP(NUMBER_VAL, +);
+                break;
+            case OP_R_FSUBTRACT:
+                NUMBER_OP(NUMBER_VAL, -);
+                break;
+            case OP_R_FMULTIPLY:
+                NUMBER_OP(NUMBER_VAL, *);
+                break;
+            case OP_R_FDIVIDE:
+                NUMBER_OP(NUMBER_VAL, /);
+                break;
+            case OP_R_FGREATER:
+                NUMBER_OP(BOOL_VAL, >);
+                break;
+            case OP_R_FLESS:
+                NUMBER_OP(BOOL_VAL, <);
+                break;
+            case OP_R_FEQUAL:
+                NUMBER_OP(BOOL_VAL, ==);
+                break;
+            case OP_R_CONCAT:
+                READ_OPERANDS();
+                *dst = concatenate(AS_STRING(a), AS_STRING(b));
+                break;
+            // Unary instructions carry an unused second operand, so every instruction is four bytes.
+            case OP_R_NOT:
+                READ_OPERANDS();
+                *dst = BOOL_VAL(isFalsey(a));
+                break;
+            case OP_R_NEGATE:
+                READ_OPERANDS();
+                if (!IS_NUMBER(a)) {
+                    runtimeError("Operand must be a number.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                *dst = NUMBER_VAL(-AS_NUMBER(a));
+                break;
+            case OP_R_FNEGATE:
+                READ_OPERANDS();
+                *dst = NUMBER_VAL(-AS_NUMBER(a));
+                break;
+            case OP_R_RETURN: {
+                Value result = READ_RK();
+                vm.stackTop = registers;
+                writeValue(&vm.out, result);
+                writeChar(&vm.out, '\n');
+                return INTERPRET_OK;
+            }
+        }
+    }
+#undef READ_BYTE
+#undef READ_RK
+#undef READ_OPERANDS
+#undef NUMBER_OP
 #undef BINARY_OP
 }
 
 // 先编译(compile)成字节码，再解释执行(run)
 InterpretResult interpret(const char *source) {
-    // The compiler will take the user’s program and fill up the chunk with bytecode.
+    return interpretLength(source, strlen(source));
+}
+
+// A chunk that goes in the cache outlives the evaluation, and so do the strings among its constants,
+// so it is compiled on the heap even in arena mode. Returns NULL after a compile error.
+static Chunk *compileCached(const char *source, size_t length) {
+    bool inArena = vm.inArena;
+    vm.inArena = false;
     Chunk chunk;
     initChunk(&chunk);
-    if (!compile(source, &chunk)) {
+    Chunk *cached = NULL;
+    if (compile(source, length, &chunk)) {
+        cached = cacheChunk(&vm.cache, source, length, &chunk);
+    } else {
+        freeChunk(&chunk);
+    }
+    vm.inArena = inArena;
+    return cached;
+}
+
+InterpretResult interpretLength(const char *source, size_t length) {
+    // The compiler will take the user’s program and fill up the chunk with bytecode.
+    if (vm.arenaMode) beginArena();
+    InterpretResult result = INTERPRET_COMPILE_ERROR;
+    // A chunk from the image or the cache is kept; otherwise it is compiled for this one run.
+    Chunk *kept = findPreloadedChunk(&vm.image, source, length);
+    bool caching = kept == NULL && vm.cache.capacity > 0;
+    if (caching) {
+        kept = findCachedChunk(&vm.cache, source, length);
+        if (kept == NULL) kept = compileCached(source, length);
+    }
+    if (kept != NULL) {
+        result = interpretChunk(kept);
+    } else if (!caching) {
+        Chunk chunk;
+        initChunk(&chunk);
+        if (compile(source, length, &chunk)) result = interpretChunk(&chunk);
         freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
     }
+    if (vm.arenaMode) endArena();
+    return result;
+}
+
+// Runs vm.chunk from vm.ip. Machine code always runs to the end, so it is only used without a budget.
+static InterpretResult execute(Value *frame, int budget) {
+    if (vm.chunk->registers) return runRegisters(frame, budget);
+#ifdef JIT_AVAILABLE
+    if (vm.chunk->native != NULL && budget == NO_BUDGET && vm.ip == vm.chunk->code) return jitRun(vm.chunk);
+#endif
+    return run(frame, budget);
+}
+
+// outOfMemory() lands here, from run() or from the C the JIT's code called into. runtimeError() has
+// already reset the stack, and whatever the chunk allocated so far is in vm.heap or in the arena.
+static InterpretResult protectedExecute(Value *frame, int budget) {
+    jmp_buf errorJump;
+    if (setjmp(errorJump) != 0) {
+        vm.errorJump = NULL;
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.errorJump = &errorJump;
+    InterpretResult result = execute(frame, budget);
+    vm.errorJump = NULL;
+    return result;
+}
+
+// Runs vm.chunk with the nursery open, unless this is an arena evaluation, and empties it afterwards. Only
+// a suspended run still holds values: its stack, or for register code every register.
+static InterpretResult executeInNursery(Value *frame, int budget) {
+    const Chunk *chunk = vm.chunk;
+    vm.nursery.open = !vm.inArena;
+    InterpretResult result = protectedExecute(frame, budget);
+    vm.nursery.open = false;
+    int rootCount = 0;
+    if (result == INTERPRET_SUSPENDED) rootCount = chunk->registers ? chunk->maxStack : (int) (vm.stackTop - frame);
+    emptyNursery(&vm.nursery, frame, rootCount);
+    return result;
+}
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+// The sampling timer may look at vm.chunk at any moment, so while it runs vm.chunk is cleared as soon as
+// the chunk stops, before it can be freed. The fence keeps the compiler from dropping or sinking the store.
+static void stopSample(const Chunk *chunk) {
+    if (!vm.sampling) return;
+    vm.chunk = NULL;
+    atomic_signal_fence(memory_order_seq_cst);
+    attributeSamples(chunk);
+}
+
+InterpretResult interpretChunk(Chunk *chunk) {
+    // vm.ip first, so the sampling timer never reads this chunk against an ip left from another.
+    vm.ip = chunk->code;
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.chunk = chunk;
+    ensureStack((int) (vm.stackTop - vm.stack) + chunk->maxStack);
+#ifdef JIT_AVAILABLE
+    // If compiling fails the count starts over, so it is not retried on every run.
+    if (!vm.sampling && !chunk->registers && chunk->native == NULL && ++chunk->runs >= JIT_THRESHOLD &&
+        !jitCompile(chunk)) {
+        chunk->runs = 0;
+    }
+#endif
+    InterpretResult result = executeInNursery(vm.stackTop, NO_BUDGET);
+    stopSample(chunk);
+    return result;
+}
 
-    InterpretResult result = run();
-    freeChunk(&chunk);
+InterpretResult resumeChunk(Value *frame, int budget) {
+    const Chunk *chunk = vm.chunk;
+    InterpretResult result = executeInNursery(frame, budget);
+    stopSample(chunk);
     return result;
 }
 
+Value *runSlowPath(Value *stackTop, Value *frame, uint8_t *ip) {
+    vm.stackTop = stackTop;
+    vm.ip = ip + 1;  // where run() would be when it reports an error
+    switch (*ip) {
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_CONCAT: {
+            Value b = stackTop[-1];
+            Value a = stackTop[-2];
+            if (IS_STRING(b) && IS_STRING(a)) {
+                stackTop[-2] = concatenate(AS_STRING(a), AS_STRING(b));
+            } else if (IS_NUMBER(b) && IS_NUMBER(a)) {
+                stackTop[-2] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else {
+                runtimeError("Operands must be two numbers or two strings.");
+                return NULL;
+            }
+            return stackTop - 1;
+        }
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER:
+        case OP_LESS: {
+            // The machine code has already handled two numbers.
+            runtimeError("Operands must be numbers.");
+            return NULL;
+        }
+        case OP_NEGATE:
+            runtimeError("Operand must be a number.");
+            return NULL;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+            stackTop[-2] = BOOL_VAL(valuesEqual(stackTop[-2], stackTop[-1]));
+            return stackTop - 1;
+        case OP_NOT:
+            stackTop[-1] = BOOL_VAL(isFalsey(stackTop[-1]));
+            return stackTop;
+        case OP_RETURN: {
+            Value result = stackTop[-1];
+            vm.stackTop = frame;
+            writeValue(&vm.out, result);
+            writeChar(&vm.out, '\n');
+            return frame;
+        }
+        default:
+            // The JIT only calls back for the instructions above; anything else is a bug in jit.c, so it is
+            // reported rather than turned into a silent runtime error.
+            runtimeError("Internal error: no slow path for %s.", opcodeName(*ip));
+            return NULL;
+    }
+}
+
 void push(Value value) {
     *vm.stackTop = value;
     vm.stackTop++;
@@ -5,34 +5,115 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <limits.h>
+#include <setjmp.h>
+
+#include "arena.h"
+#include "cache.h"
 #include "chunk.h"
+#include "heap.h"
+#include "image.h"
+#include "nursery.h"
 #include "value.h"
 #include "table.h"
+#include "writer.h"
 
-#define STACK_MAX 256
 typedef struct {
     Chunk *chunk;
     uint8_t *ip;  // it keeps tracks of where it is the location of the instruction currently being executed
-    Value stack[STACK_MAX];  // index 0 refer stack bottom
+    Value *stack;  // index 0 refer stack bottom; grown before run() to the chunk's maxStack
+    int stackCapacity;
     Value *stackTop;  // 后续的操作都是对stackTop指针进行的，而不是进行数组索引
     Table strings;  // 存储所有的字符串，相同的字符串总是引用同一个地址
-    Obj *objects;//The VM stores a pointer to the head of the list.
+    Heap heap;  // every object not in the arena, an image or the nursery
+    Nursery nursery;  // strings concatenate() makes while a chunk runs
+    Writer out;  // results go here; the host decides when to flush it
+    Writer err;  // compile and runtime errors, flushed after each one when it has a file
+    // Arena mode (setArenaMode()): each interpret() allocates from the arena and drops it all at the end.
+    bool arenaMode;
+    bool inArena;  // an arena evaluation is running
+    Arena arena;
+    Table arenaStrings;  // strings interned during the current arena evaluation, themselves in the arena
+    Image image;  // strings and chunks preloaded from a heap image, if one was loaded
+    ChunkCache cache;  // recently compiled chunks, when setChunkCacheCapacity() has turned it on
+    bool sampling;  // --sample is on: vm.chunk is only set while a chunk runs, and nothing is JIT compiled
+    // The heap limit (setHeapLimit()), 0 for none, and what reallocate() has handed out against it.
+    size_t heapLimit;
+    size_t bytesAllocated;
+    jmp_buf *errorJump;  // set while a chunk runs: an allocation that cannot be met unwinds to it
+    // Characters an unfinished allocateString() owns, so unwinding can free them.
+    char *looseChars;
+    int looseLength;
 } VM;
 
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_SUSPENDED  // resumeChunk() used up its budget before the chunk finished
 } InterpretResult;
 
+// The instruction budget of a run that goes to the end. No chunk has this many instructions.
+#define NO_BUDGET INT_MAX
+
 void initVM();
 
 void freeVM();
 
 InterpretResult interpret(const char *source);
 
+// Like interpret(), for source that is not '\0' terminated (a mapped file, a slice of a buffer).
+InterpretResult interpretLength(const char *source, size_t length);
+
+// Runs a chunk that was compiled earlier and leaves it for the caller to free, so one compile() can be
+// evaluated many times. Instructions that keep seeing the same operand types are quickened in place,
+// which makes the later runs cheaper, and a chunk run JIT_THRESHOLD times is compiled to machine code.
+InterpretResult interpretChunk(Chunk *chunk);
+
+// Carries on with vm.chunk at vm.ip for at most budget instructions, on the stack vm.stack and vm.stackTop
+// describe. frame is where the chunk's stack began, vm.stackTop when it was first started. Returns
+// INTERPRET_SUSPENDED if the budget ran out first; everything needed to go on is then in vm.ip and the
+// stack, so the caller can put them aside and resume later (scheduler.c does).
+InterpretResult resumeChunk(Value *frame, int budget);
+
+// In arena mode everything one interpret() call allocates (its chunk, the compiler's working memory,
+// the strings it creates) comes from a bump arena that is reset in O(1) once the result is written.
+void setArenaMode(bool enabled);
+
+// Bounds the memory scripts can hold through reallocate(): interned strings, chunks, tables and, in arena
+// mode, the arena's blocks. A running chunk that needs more fails with a runtime error, the VM stays
+// usable and the process keeps going. 0 (the default) means no limit. The compiler and the VM's own
+// stack and output buffer are not held to it.
+void setHeapLimit(size_t bytes);
+
+// How much more reallocate() may hand out right now: SIZE_MAX unless a limit is set and a chunk is running.
+size_t heapHeadroom();
+
+// Allocation failed. While a chunk runs this reports a runtime error and unwinds to interpretChunk();
+// otherwise it exits like running out of memory always did.
+void outOfMemory();
+
+// Keeps up to capacity compiled chunks, least recently used out first, so interpretLength() only compiles
+// a source it has not seen lately. 0, the default, turns the cache off. Changing it empties the cache.
+void setChunkCacheCapacity(int capacity);
+
+// Copies a value made during the current arena evaluation to the heap, so it survives the reset.
+// Use the returned value from then on.
+Value retainValue(Value value);
+
+// For code that runs outside the interpreter loop (aot.c): the runtime error report with the line given
+// directly rather than taken from vm.ip, and string +.
+void runtimeErrorAt(int line, const char *format, ...);
+
+Value concatenate(ObjString const *a, ObjString const *b);
+
+// Executes the instruction at ip the way run() would, on a stack that is entirely in memory. The JIT calls
+// it for whatever it has no machine code for. Returns the new stack top, or NULL after a runtime error.
+Value *runSlowPath(Value *stackTop, Value *frame, uint8_t *ip);
+
 extern VM vm;
 
+// push() does no bounds check; the stack is only guaranteed to hold chunk->maxStack values.
 void push(Value value);
 
 Value pop();
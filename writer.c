@@ -0,0 +1,85 @@
+//
+// Created by neepoo on 23-2-2.
+//
+#include <string.h>
+
+#include "memory.h"
+#include "writer.h"
+
+void initWriter(Writer *writer, FILE *file) {
+    writer->chars = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    writer->file = file;
+}
+
+void freeWriter(Writer *writer) {
+    FREE_HEAP_ARRAY(char, writer->chars, writer->capacity);
+    initWriter(writer, writer->file);
+}
+
+static void reserve(Writer *writer, int length) {
+    if (writer->capacity - writer->count >= length) return;
+    if (writer->file != NULL) {
+        // A file-backed writer never grows past its block size, it drains instead.
+        flushWriter(writer);
+        if (writer->capacity == 0) {
+            writer->capacity = WRITER_BUFFER_SIZE;
+            writer->chars = ALLOCATE_HEAP(char, writer->capacity);
+        }
+        return;
+    }
+    int oldCapacity = writer->capacity;
+    while (writer->capacity - writer->count < length) {
+        writer->capacity = GROW_CAPACITY(writer->capacity);
+    }
+    writer->chars = GROW_HEAP_ARRAY(char, writer->chars, oldCapacity, writer->capacity);
+}
+
+void writeChars(Writer *writer, const char *chars, int length) {
+    if (length == 0) return;
+    reserve(writer, length);
+    if (writer->capacity - writer->count < length) {
+        // Bigger than a whole block; skip the copy.
+        fwrite(chars, sizeof(char), (size_t) length, writer->file);
+        return;
+    }
+    memcpy(writer->chars + writer->count, chars, (size_t) length);
+    writer->count += length;
+}
+
+void writeChar(Writer *writer, char c) {
+    if (writer->count == writer->capacity) reserve(writer, 1);
+    writer->chars[writer->count++] = c;
+}
+
+void writeFormat(Writer *writer, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    writeFormatV(writer, format, args);
+    va_end(args);
+}
+
+void writeFormatV(Writer *writer, const char *format, va_list args) {
+    // Error messages are short; only one quoting a long token needs the heap.
+    char buffer[256];
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(buffer, sizeof(buffer), format, copy);
+    va_end(copy);
+    if (length < 0) return;
+    if ((size_t) length < sizeof(buffer)) {
+        writeChars(writer, buffer, length);
+        return;
+    }
+    char *chars = ALLOCATE_HEAP(char, length + 1);
+    vsnprintf(chars, (size_t) length + 1, format, args);
+    writeChars(writer, chars, length);
+    FREE_HEAP_ARRAY(char, chars, length + 1);
+}
+
+void flushWriter(Writer *writer) {
+    if (writer->file == NULL || writer->count == 0) return;
+    fwrite(writer->chars, sizeof(char), (size_t) writer->count, writer->file);
+    writer->count = 0;
+}
@@ -0,0 +1,39 @@
+//
+// Created by neepoo on 23-2-2.
+//
+
+#ifndef clox_writer_h
+#define clox_writer_h
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "common.h"
+
+#define WRITER_BUFFER_SIZE (1 << 16)
+
+// An output buffer that collects many small writes and hands them to a FILE in big blocks.
+// With a NULL file it simply grows and keeps everything in memory.
+typedef struct {
+    char *chars;
+    int count;
+    int capacity;
+    FILE *file;
+} Writer;
+
+void initWriter(Writer *writer, FILE *file);
+
+void freeWriter(Writer *writer);
+
+void writeChars(Writer *writer, const char *chars, int length);
+
+void writeChar(Writer *writer, char c);
+
+// printf() into the writer.
+void writeFormat(Writer *writer, const char *format, ...);
+
+void writeFormatV(Writer *writer, const char *format, va_list args);
+
+void flushWriter(Writer *writer);
+
+#endif